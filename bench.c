@@ -0,0 +1,559 @@
+/*
+ * Headless benchmark.
+ *
+ * Builds the editor from kilo.c with its main() renamed, generates a
+ * few files that stress different paths (many short lines, a few huge
+ * lines, tabs, UTF-8), and for each one measures how fast it loads
+ * and how long every scripted keystroke takes to reach the screen.
+ * Keys are placed straight into the editor's input buffer and the
+ * screen is written to /dev/null, so no terminal is involved; its
+ * size is taken from a pseudo-terminal that is never written to.
+ *
+ * After the key script, rows are inserted, deleted and changed at
+ * random through the same calls an edit command would make, and the
+ * rows are checked against a model of what they should hold.
+ *
+ * Usage: ./bench [scale]
+ * scale multiplies the size of every generated file (default 1).
+ */
+#define main kilo_main
+#include "kilo.c"
+#undef main
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+#define BENCH_EDITS 300
+
+/*
+ * A step of a key script: keys are fed to the editor repeat times,
+ * and each time the screen is refreshed once they are consumed.  A
+ * step with keys NULL goes to the line in the middle of the file.
+ */
+struct bench_step {
+	char *keys;
+	int repeat;
+};
+
+static struct bench_step bench_script[] = {
+	{"\x1b[B", 500},
+	{"\x1b[6~", 200},
+	{"\x1b[5~", 100},
+	{"\x1b[F", 1},
+	{"\x1b[D", 300},
+	{"\x1b[C", 300},
+	{"\x1b[H", 1},
+	{NULL, 1},
+	{"\x1b[B", 200},
+	{"\x06kilo-bench\r", 1},
+	{"\x07" "1\r", 1},
+};
+
+#define BENCH_STEPS (sizeof(bench_script) / sizeof(bench_script[0]))
+
+/*
+ * Latencies of the steps run so far, in nanoseconds.
+ */
+struct bench_samples {
+	double *ns;
+	int n;
+	int cap;
+};
+
+double bench_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void bench_sample(struct bench_samples *s, double ns)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->ns = realloc(s->ns, sizeof(double) * s->cap);
+		if (s->ns == NULL) {
+			die("realloc");
+		}
+	}
+	s->ns[s->n++] = ns;
+}
+
+int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+double bench_percentile(struct bench_samples *s, double p)
+{
+	if (s->n == 0) {
+		return 0;
+	}
+	int i = (int)(p / 100 * (s->n - 1) + 0.5);
+	return s->ns[i];
+}
+
+/*
+ * Workload generators.  Each writes one line of the file to buf and
+ * returns its length; i is the line number.
+ */
+typedef int (*bench_line_fn)(char *buf, int i);
+
+int bench_short_line(char *buf, int i)
+{
+	return sprintf(buf, "%08d the quick brown fox jumps over the "
+		"lazy dog\n", i);
+}
+
+/*
+ * 4MB per line, of words separated by spaces and the odd tab.
+ */
+int bench_huge_line(char *buf, int i)
+{
+	static const char *words[] = {
+		"alpha", "beta", "gamma", "delta", "epsilon", "zeta"
+	};
+	int len = 0;
+	while (len < (4 << 20)) {
+		len += sprintf(&buf[len], "%s%c", words[(len + i) % 6],
+			len % 97 == 0 ? '\t' : ' ');
+	}
+	buf[len++] = '\n';
+	return len;
+}
+
+int bench_tab_line(char *buf, int i)
+{
+	return sprintf(buf, "\t%d\t\tkey\t=\tvalue\t%d\t\t\t;\tcomment\n",
+		i, i * 7);
+}
+
+int bench_utf8_line(char *buf, int i)
+{
+	return sprintf(buf, "%d: naïve café — 日本語のテキスト "
+		"e\xcc\x81 Ελληνικά 한국어 \xf0\x9f\x98\x80\n", i);
+}
+
+/*
+ * C, so that it is highlighted, with block comments that span lines.
+ */
+int bench_c_line(char *buf, int i)
+{
+	switch (i % 8) {
+		case 0:
+			return sprintf(buf, "/*\n");
+		case 1:
+			return sprintf(buf, " * Function %d.\n", i);
+		case 2:
+			return sprintf(buf, " */\n");
+		case 3:
+			return sprintf(buf, "static int f%d(char *s, int n)\n",
+				i);
+		case 4:
+			return sprintf(buf, "{\n");
+		case 5:
+			return sprintf(buf, "\treturn n > %d ? strlen(\"%d\") : "
+				"n * 0x%x; // %d\n", i, i, i, i);
+		case 6:
+			return sprintf(buf, "}\n");
+		default:
+			return sprintf(buf, "\n");
+	}
+}
+
+/*
+ * suffix is the end of the file name, which picks its file type.
+ */
+struct bench_workload {
+	char *name;
+	char *suffix;
+	bench_line_fn line;
+	int lines;
+	size_t linemax;
+};
+
+static struct bench_workload bench_workloads[] = {
+	{"short-lines", "", bench_short_line, 1000000, 128},
+	{"huge-lines", "", bench_huge_line, 4, (4 << 20) + 64},
+	{"tabs", "", bench_tab_line, 300000, 128},
+	{"utf8", "", bench_utf8_line, 300000, 256},
+	{"c-source", ".c", bench_c_line, 1000000, 128},
+};
+
+#define BENCH_WORKLOADS \
+	(sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+/*
+ * Write the workload to a temporary file and return its path.  *size
+ * is set to its length.
+ */
+char *bench_generate(struct bench_workload *w, int scale, size_t *size)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/kilo-bench-XXXXXX%s", w->suffix);
+	int fd = mkstemps(path, strlen(w->suffix));
+	if (fd == -1) {
+		die("mkstemps");
+	}
+	FILE *fp = fdopen(fd, "w");
+	char *buf = malloc(w->linemax);
+	if (fp == NULL || buf == NULL) {
+		die("bench_generate");
+	}
+
+	*size = 0;
+	for (int i = 0; i < w->lines * scale; i++) {
+		int len = w->line(buf, i);
+		fwrite(buf, 1, len, fp);
+		*size += len;
+	}
+	if (fclose(fp) == EOF) {
+		die("fclose");
+	}
+	free(buf);
+	return strdup(path);
+}
+
+/*
+ * Feed keys to the editor and refresh the screen once they have all
+ * been processed.  Returns how long that took, in nanoseconds.
+ */
+double bench_keys(char *keys, int len)
+{
+	double start = bench_now();
+
+	memcpy(E.inbuf, keys, len);
+	E.inlen = len;
+	E.inpos = 0;
+	while (E.inpos < E.inlen) {
+		editor_process_keypress();
+		editor_scroll();
+	}
+	editor_refresh_screen();
+	return bench_now() - start;
+}
+
+/*
+ * What a row of the edited file should hold: len bytes at s, with the
+ * first nhead of them replaced by head.  s is the text the row had
+ * when it was loaded, which stays where it is when the row is given a
+ * copy, or text the benchmark inserted, in which case owned is set.
+ */
+struct bench_row {
+	char *s;
+	int len;
+	int owned;
+	int nhead;
+	char head[2];
+};
+
+void bench_fail(char *what, int at)
+{
+	fprintf(stderr, "bench: %s at row %d\n", what, at);
+	exit(1);
+}
+
+/*
+ * Check the block index and every row's text against the model.
+ */
+void bench_check(struct bench_row *model, int n)
+{
+	if (n != E.doc->numrows) {
+		bench_fail("row count differs", n);
+	}
+	int start = 0;
+	for (int i = 0; i < E.doc->nblocks; i++) {
+		if (E.doc->blockstart[i] != start || E.doc->blocks[i]->n == 0) {
+			bench_fail("bad block", start);
+		}
+		start += E.doc->blocks[i]->n;
+	}
+	if (start != n) {
+		bench_fail("blocks do not cover the rows", start);
+	}
+
+	for (int i = 0; i < n; i++) {
+		erow *row = editor_row_at(i);
+		struct bench_row *m = &model[i];
+		if (row->size != m->len ||
+				memcmp(row->chars, m->head, m->nhead) != 0 ||
+				memcmp(&row->chars[m->nhead], &m->s[m->nhead],
+					m->len - m->nhead) != 0) {
+			bench_fail("text differs", i);
+		}
+	}
+
+	/*
+	 * Highlight states that are not guesses have to be what a scan
+	 * from the top gives, and so do all of them once the guesses
+	 * have been put right.
+	 */
+	if (E.doc->syntax == NULL) {
+		return;
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		int open = 0;
+		for (int i = 0; i < n; i++) {
+			erow *row = editor_row_at(i);
+			open = editor_hl_row(row, open, NULL);
+			unsigned int info = row->info;
+			if (pass && info & ROW_HL_GUESS) {
+				bench_fail("guessed highlight state left", i);
+			}
+			if ((info & (ROW_HL_VALID | ROW_HL_GUESS)) ==
+					ROW_HL_VALID &&
+					((info & ROW_HL_OPEN) != 0) != open) {
+				bench_fail("stale highlight state", i);
+			}
+		}
+		while (editor_hl_pending()) {
+			editor_hl_idle();
+		}
+	}
+}
+
+/*
+ * Insert, delete and change rows at random, refreshing the screen
+ * with the cursor on each, and sample how long each edit takes to
+ * reach the screen.  The inserted lines open and close comments, so
+ * that in a C file a change can alter the highlighting of the rows
+ * after it.
+ */
+void bench_edits(struct bench_samples *s)
+{
+	static const char *lines[] = {
+		"/* edit %d", "edit %d */", "int edit%d;"
+	};
+	int n = E.doc->numrows;
+	struct bench_row *model = malloc(sizeof(*model) * (n + BENCH_EDITS));
+	if (model == NULL) {
+		die("malloc");
+	}
+	for (int i = 0; i < n; i++) {
+		erow *row = editor_row_at(i);
+		model[i] = (struct bench_row){row->chars, row->size, 0, 0, ""};
+	}
+
+	/*
+	 * Let the highlighting guessed during the script be put right,
+	 * as it would be while the editor waits for keys, so that edits
+	 * land on rows whose states are known.
+	 */
+	while (editor_hl_pending()) {
+		editor_hl_idle();
+	}
+
+	unsigned int seed = 1;
+	for (int e = 0; e < BENCH_EDITS; e++) {
+		seed = seed * 1103515245 + 12345;
+		int op = n > 0 ? (seed >> 16) % 3 : 0;
+		int at = n > 0 ? (int)((seed >> 4) % n) : 0;
+		if (op == 2 && editor_row_at(at)->size < 2) {
+			op = 0;
+		}
+
+		double start = bench_now();
+		char text[32];
+		int len = 0;
+		if (op == 0) {
+			len = sprintf(text, lines[e % 3], e);
+			editor_insert_row(at, text, len);
+		} else if (op == 1) {
+			editor_del_row(at);
+		} else {
+			erow *row = editor_row_at(at);
+			editor_row_own(row);
+			memcpy(row->chars, e % 2 ? "*/" : "/*", 2);
+			editor_invalidate_row(at);
+		}
+		E.cy = at;
+		E.cx = 0;
+		editor_scroll();
+		editor_refresh_screen();
+		bench_sample(s, bench_now() - start);
+
+		if (op == 0) {
+			memmove(&model[at + 1], &model[at],
+				sizeof(*model) * (n - at));
+			model[at] = (struct bench_row){strdup(text), len, 1, 0,
+				""};
+			n++;
+		} else if (op == 1) {
+			if (model[at].owned) {
+				free(model[at].s);
+			}
+			memmove(&model[at], &model[at + 1],
+				sizeof(*model) * (n - at - 1));
+			n--;
+		} else {
+			memcpy(model[at].head, e % 2 ? "*/" : "/*", 2);
+			model[at].nhead = 2;
+		}
+	}
+
+	bench_check(model, n);
+
+	/*
+	 * Rows now own text the mapping does not hold, so searches go row
+	 * by row; every inserted line left has to be found.  None of the
+	 * generated files contains the word.
+	 */
+	size_t inserted = 0;
+	for (int i = 0; i < n; i++) {
+		if (model[i].owned) {
+			inserted++;
+			free(model[i].s);
+		}
+	}
+	free(model);
+	size_t count = 0;
+	editor_search(SEARCH_COUNT, "edit", 0, 0, n, NULL, &count);
+	if (count != inserted) {
+		bench_fail("search misses inserted rows", (int)count);
+	}
+}
+
+/*
+ * Put the editor back in the state of a fresh start, with no file.
+ */
+void bench_reset()
+{
+	editor_close();
+	E.cx = 0;
+	E.cy = 0;
+	E.rx = 0;
+	E.rowoff = 0;
+	E.coloff = 0;
+	E.gotowait = 0;
+	E.shadowvalid = 0;
+	E.statusmsg[0] = '\0';
+}
+
+void bench_run(struct bench_workload *w, int scale)
+{
+	size_t size;
+	char *path = bench_generate(w, scale, &size);
+
+	/*
+	 * The generated files are mapped, so loading ends when the
+	 * loader's final batch has been collected.
+	 */
+	double start = bench_now();
+	editor_open(path);
+	while (E.doc->loading) {
+		struct pollfd pfd = { E.doc->loader->notifyfd[0], POLLIN, 0 };
+		poll(&pfd, 1, -1);
+		editor_collect_rows();
+	}
+	double load = bench_now() - start;
+	int numrows = E.doc->numrows;
+
+	struct bench_samples s = {NULL, 0, 0};
+	long long written = E.stats.written;
+	char keys[64];
+	for (size_t i = 0; i < BENCH_STEPS; i++) {
+		struct bench_step *step = &bench_script[i];
+		char *k = step->keys;
+		if (k == NULL) {
+			snprintf(keys, sizeof(keys), "\x07%d\r",
+				numrows / 2 + 1);
+			k = keys;
+		}
+		for (int j = 0; j < step->repeat; j++) {
+			bench_sample(&s, bench_keys(k, strlen(k)));
+		}
+	}
+	written = E.stats.written - written;
+
+	struct bench_samples edits = {NULL, 0, 0};
+	bench_edits(&edits);
+
+	qsort(s.ns, s.n, sizeof(double), bench_cmp);
+	qsort(edits.ns, edits.n, sizeof(double), bench_cmp);
+	printf("%-12s %8.1f MB %9d rows %8.1f MB/s | "
+		"p50 %7.3f p90 %7.3f p99 %7.3f max %8.3f ms | "
+		"%9lld bytes, %6.0f/frame\n",
+		w->name, size / 1048576.0, numrows,
+		size / 1048576.0 / (load / 1e9),
+		bench_percentile(&s, 50) / 1e6,
+		bench_percentile(&s, 90) / 1e6,
+		bench_percentile(&s, 99) / 1e6,
+		s.ns[s.n - 1] / 1e6,
+		written, (double)written / s.n);
+	printf("%-12s %34d edits | "
+		"p50 %7.3f p90 %7.3f p99 %7.3f max %8.3f ms\n",
+		"", edits.n,
+		bench_percentile(&edits, 50) / 1e6,
+		bench_percentile(&edits, 90) / 1e6,
+		bench_percentile(&edits, 99) / 1e6,
+		edits.ns[edits.n - 1] / 1e6);
+
+	free(s.ns);
+	free(edits.ns);
+	bench_reset();
+	unlink(path);
+	free(path);
+}
+
+/*
+ * The editor sizes itself from the terminal it writes to; a pty of the
+ * benchmark's size stands in for one while it starts up.
+ */
+int bench_terminal()
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 ||
+			unlockpt(master) == -1) {
+		die("posix_openpt");
+	}
+	int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave == -1) {
+		die("open pty");
+	}
+	struct winsize ws;
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_row = BENCH_ROWS;
+	ws.ws_col = BENCH_COLS;
+	if (ioctl(slave, TIOCSWINSZ, &ws) == -1) {
+		die("ioctl");
+	}
+	return slave;
+}
+
+int main(int argc, char *argv[])
+{
+	int scale = argc > 1 ? atoi(argv[1]) : 1;
+	if (scale < 1) {
+		scale = 1;
+	}
+
+	/*
+	 * Keys never arrive on ttyfd: it is the read end of a pipe
+	 * nobody writes to, so the event loop only wakes for the
+	 * loader.
+	 */
+	int keypipe[2];
+	if (pipe(keypipe) == -1) {
+		die("pipe");
+	}
+	E.ttyfd = keypipe[0];
+	E.outfd = bench_terminal();
+	init_editor();
+	close(E.outfd);
+	E.outfd = open("/dev/null", O_WRONLY);
+	if (E.outfd == -1) {
+		die("open /dev/null");
+	}
+
+	int steps = 0;
+	for (size_t i = 0; i < BENCH_STEPS; i++) {
+		steps += bench_script[i].repeat;
+	}
+	printf("%d x %d screen, %d frames per workload\n", BENCH_COLS,
+		BENCH_ROWS, steps);
+	for (size_t i = 0; i < BENCH_WORKLOADS; i++) {
+		bench_run(&bench_workloads[i], scale);
+	}
+	return 0;
+}
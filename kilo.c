@@ -4,16 +4,56 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
+#define KILO_RX_MARK_STEP 4096
+#define KILO_WINDOW_ROW (4 * KILO_RX_MARK_STEP)
+#define KILO_READ_SIZE (1 << 20)
+#define KILO_LOAD_BATCH 4096
+#define KILO_LOAD_RING 65536
+#define KILO_LOAD_SAMPLE (1 << 20)
+#define KILO_INPUT_SIZE 4096
+#define KILO_ESC_TIMEOUT 100
+#define KILO_MAX_WATCHES 8
+#define KILO_MSG_TIMEOUT 5
+#define KILO_SEARCH_ROWS 16384
+#define KILO_SEARCH_MAX_THREADS 64
+
+/*
+ * Upper bound on screen refreshes per second; 0 disables the limit.
+ */
+#ifndef KILO_MAX_FPS
+#define KILO_MAX_FPS 60
+#endif
+
+/*
+ * Memory a pager (kilo -) keeps for rows; older rows are dropped.
+ */
+#ifndef KILO_PAGER_LIMIT
+#define KILO_PAGER_LIMIT (64 << 20)
+#endif
 
 /*
  * This mirrors what the CTRL key does in the terminal: it strips the
@@ -34,6 +74,7 @@
  * that they don't conflict with any ordinary keypresses.
  */
 enum editor_key {
+	BACKSPACE = 127,
 	ARROW_LEFT = 1000,
 	ARROW_RIGHT,
 	ARROW_UP,
@@ -45,12 +86,367 @@ enum editor_key {
 	PAGE_DOWN
 };
 
+/*
+ * A row is 16 bytes, since a large file has millions of them.  info
+ * holds the ROW_* flags in its low bits, and above them the slot of
+ * the row's render in E.doc->renders.  Slot 0 means the row has no render
+ * of its own: without tabs, what is drawn is chars itself.
+ */
 typedef struct erow {
+	char *chars;
 	int size;
+	unsigned int info;
+} erow;
+
+/*
+ * ROW_MAPPED is set when chars points into the file mapping instead
+ * of a copy in the arena.  Mapped rows are read-only, and are not
+ * NUL-terminated.
+ *
+ * ROW_DIRTY is set when the render is missing or out of date.  It is
+ * only built when the row is about to be drawn, so rows that are
+ * never scrolled into view never get one.
+ *
+ * ROW_UTF8 is set when the row is first rendered if it holds bytes
+ * outside ASCII, whose columns have to be measured when drawing.
+ * Short rows with UTF-8 get no render and are measured from chars.
+ *
+ * ROW_HL_VALID is set once the highlight state at the end of the row
+ * is known, and ROW_HL_OPEN then tells whether a multi-line comment
+ * is still open there.  ROW_HL_GUESS marks a state that rests on a
+ * guess rather than on the rows above; see editor_hl_state().
+ */
+#define ROW_MAPPED 1
+#define ROW_DIRTY 2
+#define ROW_UTF8 4
+#define ROW_HL_VALID 8
+#define ROW_HL_OPEN 16
+#define ROW_HL_GUESS 32
+#define ROW_SLOT_SHIFT 6
+
+/*
+ * What is drawn on screen for a row.  Like chars, it is not
+ * necessarily NUL-terminated; only rsize bytes are valid.
+ *
+ * Rows of KILO_WINDOW_ROW bytes or more are never expanded whole.
+ * They keep marks instead, the column at every KILO_RX_MARK_STEP
+ * bytes, and only the part in view is expanded as it is drawn.
+ */
+struct erender {
+	char *render;
 	int rsize;
+	int *marks;
+	int nmarks;
+};
+
+/*
+ * Rows are stored in blocks of up to KILO_ROW_BLOCK rows instead of
+ * one flat array, so that inserting or deleting a line only moves the
+ * rest of its block rather than every row after it.  blockstart[i] is
+ * the index of the first row of blocks[i].  Rows are only appended
+ * while a file loads, which leaves every block but the last one full;
+ * a row's block is then found by division, and by binary search over
+ * blockstart once edits have made blocks uneven.
+ */
+#define KILO_ROW_BLOCK 1024
+
+struct row_block {
+	int n;
+	erow rows[KILO_ROW_BLOCK];
+};
+
+/*
+ * Rows allocate their text from an arena instead of from malloc one
+ * by one: storage is carved sequentially out of large blocks, so
+ * consecutive rows sit next to each other in memory and carry no
+ * per-allocation header.  Nothing is freed individually; the blocks
+ * are released all at once when the file is closed.
+ */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arena_block *head;
+	size_t total;
+};
+
+/*
+ * Remembers the last cx -> rx conversion, so that moving the cursor
+ * along a row only walks the distance moved instead of the whole row
+ * from column 0.  marks[k] is the rx of cx = k * KILO_RX_MARK_STEP;
+ * moving left across a tab restarts from the nearest mark below.
+ */
+struct rx_cache {
 	char *chars;
-	char *render;
-} erow;
+	int size;
+	int cx;
+	int rx;
+	int *marks;
+	int nmarks;
+	int markcap;
+};
+
+/*
+ * Mapped files are split into rows on a loader thread, so that the
+ * page faults of reading a large file never stall the input loop.
+ * The loader hands rows over through a single-producer,
+ * single-consumer ring: it fills slots and then publishes them by
+ * advancing head, the main thread consumes them and advances tail.
+ * Neither side takes a lock.
+ *
+ * The two pipes only carry wakeups.  The loader writes a byte to
+ * notifyfd after publishing a batch, which the main thread polls
+ * together with the terminal.  When the ring is full the loader sets
+ * waiting and blocks on spacefd until the main thread has made room.
+ */
+struct loader_slot {
+	char *s;
+	size_t len;
+};
+
+struct loader {
+	pthread_t thread;
+	char *pos;
+	char *end;
+	size_t batch;
+
+	struct loader_slot ring[KILO_LOAD_RING];
+	size_t head;
+	size_t tail;
+	int waiting;
+	int stop;
+	int done;
+	size_t nlf;
+	size_t ncrlf;
+
+	int notifyfd[2];
+	int spacefd[2];
+};
+
+/*
+ * Append buffer.  Buffers keep their capacity when emptied, so the
+ * ones reused from frame to frame stop allocating once they have grown
+ * to the size of a screen.
+ */
+struct abuf {
+	char *b;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/*
+ * Stats mode (-s).  Each timer adds up the time spent in one part of
+ * the editor; last is the time of the most recent call.
+ */
+struct stats_timer {
+	long long ns;
+	long long last;
+	long calls;
+};
+
+struct editor_stats {
+	int on;
+	struct stats_timer open;
+	struct stats_timer update;
+	struct stats_timer draw;
+	struct stats_timer refresh;
+
+	/*
+	 * Frames drawn and bytes written to the terminal for them.
+	 */
+	long frames;
+	long long written;
+	long lastwritten;
+
+	/*
+	 * System calls made on the main thread, and keys read.  The
+	 * calls made from reading a batch of keys up to the end of the
+	 * frame that shows them are counted against those keys:
+	 * keymark and keysmark remember where the batch started.
+	 */
+	long long syscalls;
+	long keys;
+	long long keymark;
+	long keysmark;
+	double keysyscalls;
+
+	/*
+	 * Row store allocations: calls to the arena, and the heap
+	 * blocks it took.  rowmem is the memory taken by rows, their
+	 * renders and the block index, as of the last frame.
+	 */
+	long long allocs;
+	long heapblocks;
+	size_t rowmem;
+	size_t peakrowmem;
+};
+
+/*
+ * A descriptor the event loop polls besides the terminal, and what to
+ * do when it becomes readable.  The handler returns non-zero when the
+ * screen needs to be refreshed.
+ */
+struct editor_watch {
+	int fd;
+	int (*handler)();
+};
+
+/*
+ * Syntax highlighting.  Each byte of a row is given one of these
+ * classes while it is drawn.
+ */
+enum editor_highlight {
+	HL_NORMAL = 0,
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2,
+	HL_STRING,
+	HL_NUMBER
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+/*
+ * A file type.  filematch holds file name extensions (starting with
+ * '.') or substrings of the name.  Keywords ending in '|' are drawn
+ * as types.
+ */
+struct editor_syntax {
+	char *filetype;
+	char **filematch;
+	char **keywords;
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+};
+
+/*
+ * A document is an open file: its rows and everything that loads them.
+ * Buffers opened on the same file share its document, which is freed
+ * when the last of them is closed.  path, dev and ino identify the
+ * file; dev and ino are zero for standard input.
+ */
+struct document {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	int refs;
+
+	/*
+	 * How the file is highlighted, or NULL if it is not.  The
+	 * states of rows [0, hlexact) are known not to be guesses, and
+	 * rows from hlguessend on have none; see editor_hl_idle().
+	 */
+	struct editor_syntax *syntax;
+	int hlexact;
+	int hlguessend;
+
+	/*
+	 * Rows of the file, in blocks; see struct row_block.
+	 */
+	int numrows;
+	struct row_block **blocks;
+	int *blockstart;
+	int nblocks;
+	int blockcap;
+
+	/*
+	 * Read-only mapping of the opened file, or NULL if the file
+	 * was read in chunks with read() instead.  Unmodified rows point
+	 * straight into it.  The loader puts the first nmapped rows
+	 * there; nowned counts the rows among them that no longer do
+	 * and the mapped rows that were deleted, so that while it is
+	 * zero those rows cover the mapping contiguously.
+	 */
+	char *map;
+	size_t mapsize;
+	int nmapped;
+	int nowned;
+
+	/*
+	 * Renders of the rows that have tabs; slot 0 is unused.
+	 */
+	struct erender *renders;
+	int nrenders;
+	int rendercap;
+
+	/*
+	 * Backing store for the text and render buffers of all rows.
+	 */
+	struct arena arena;
+
+	/*
+	 * Loader state while the file is still being split into rows:
+	 * the loader thread for a mapping, or the descriptor and read
+	 * buffer when the file is not mapped.  loadbuf holds loadlen
+	 * bytes, the start of a line that has not been completed yet.
+	 */
+	int loading;
+	struct loader *loader;
+	int loadfd;
+	char *loadbuf;
+	size_t loadlen;
+	size_t loadcap;
+
+	/*
+	 * How many lines ended in LF and in CRLF, to tell which line
+	 * ending style the file uses.
+	 */
+	size_t nlf;
+	size_t ncrlf;
+
+	/*
+	 * Pager mode (kilo -): rows are read from standard input, and
+	 * the oldest are dropped to stay within KILO_PAGER_LIMIT.
+	 * rowbase counts the dropped rows, so that line numbers keep
+	 * referring to the whole input.
+	 */
+	int pager;
+	int rowbase;
+
+	/*
+	 * Follow mode: once the file is loaded, followfd stays
+	 * open and whatever is appended past followoff is read and
+	 * split into more rows.  The last line may still be incomplete;
+	 * followpartial is set while it is shown as a row, and its bytes
+	 * are kept at the start of loadbuf until its newline arrives.
+	 * inotifyfd reports changes to the file (filewd) and to its
+	 * directory (dirwd), where a rotated log is created anew.
+	 */
+	char *followpath;
+	int followfd;
+	off_t followoff;
+	int followpartial;
+	int inotifyfd;
+	int filewd;
+	int dirwd;
+};
+
+/*
+ * A buffer is a view of a document, with its own cursor and offsets
+ * and the goto it may be waiting on.
+ */
+struct buffer {
+	struct document *doc;
+	int cx;
+	int cy;
+	int rowoff;
+	int coloff;
+	int gotowait;
+	int gotorow;
+	size_t gotooff;
+};
 
 struct editor_config {
 	/*
@@ -64,6 +460,7 @@ struct editor_config {
 	 * rx is an index into the render field.
 	 */
 	int rx;
+	struct rx_cache rxc;
 
 	/*
 	 * Row and column offset.
@@ -79,20 +476,196 @@ struct editor_config {
 	int screencols;
 
 	/*
-	 * Row info for current screen.
+	 * Message shown in the bar below the text, and when it was
+	 * set; it disappears after a few seconds.
 	 */
-	int numrows;
-	erow *row;
+	char statusmsg[80];
+	time_t statusmsg_time;
+
+	/*
+	 * A goto target that has not been loaded yet: a row index or
+	 * a byte offset into the mapping, depending on gotowait.
+	 */
+	int gotowait;
+	int gotorow;
+	size_t gotooff;
+
+	/*
+	 * frame and line are the output buffers of a refresh, kept
+	 * across frames.  shadow is what was last written to each
+	 * screen row, and where the cursor was left, so that a
+	 * refresh only emits what changed.
+	 * When shadowvalid is zero the terminal contents are unknown
+	 * and everything is redrawn.
+	 */
+	struct abuf frame;
+	struct abuf line;
+	struct abuf *shadow;
+	int shadowvalid;
+	int shadowcy;
+	int shadowcx;
+	int shadowrowoff;
+
+	/*
+	 * When the last refresh was drawn, to limit the frame rate.
+	 */
+	struct timespec lastframe;
+
+	/*
+	 * Highlight of the row being drawn, one class per byte of its
+	 * chars.
+	 */
+	unsigned char *hl;
+	int hlcap;
+
+	/*
+	 * The file shown, and the buffers open on files.  The view of
+	 * the current buffer, curbuf, is what lives in E; the others
+	 * keep theirs in their struct buffer.
+	 */
+	struct document *doc;
+	struct buffer **buffers;
+	int nbuffers;
+	int curbuf;
+
+	/*
+	 * Follow mode (-f), for every file opened.
+	 */
+	int follow;
+
+	/*
+	 * Descriptors watched by the event loop, and the self-pipe the
+	 * SIGWINCH handler writes to.
+	 */
+	struct editor_watch watches[KILO_MAX_WATCHES];
+	int nwatches;
+	int winchfd[2];
+
+	/*
+	 * The terminal keys are read from: standard input, or
+	 * /dev/tty when standard input is the pager's content.  outfd
+	 * is where the screen is written: standard output, or a sink
+	 * when the editor is driven headless by bench.c.
+	 */
+	int ttyfd;
+	int outfd;
+
+	/*
+	 * Terminal input read but not consumed yet: inbuf holds inlen
+	 * bytes, of which the first inpos are consumed.
+	 */
+	char inbuf[KILO_INPUT_SIZE];
+	int inlen;
+	int inpos;
 
 	/*
 	 * Original terminal configurations.  Used to recovery to the
 	 * initial state when exit.
 	 */
 	struct termios orig_termios;
+
+	struct editor_stats stats;
 };
 
 struct editor_config E;
 
+/*
+ * Prototypes.
+ */
+void editor_set_status_message(const char *fmt, ...);
+int editor_goto_pending();
+int editor_follow_fd(int fd, off_t off);
+void editor_follow_map();
+void editor_free_rows();
+void editor_clamp_cx();
+struct erender editor_row_render(erow *row);
+erow *editor_row_at(int at);
+void editor_hl_update(int at);
+void editor_hl_shift(int at, int delta);
+
+/*
+ * Stats.  Timers only read the clock in stats mode; the counters are
+ * kept either way, since an increment costs less than testing for it.
+ */
+void stats_start(struct timespec *t)
+{
+	if (E.stats.on) {
+		clock_gettime(CLOCK_MONOTONIC, t);
+	}
+}
+
+void stats_stop(struct stats_timer *tm, struct timespec *start)
+{
+	if (!E.stats.on) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long ns = (now.tv_sec - start->tv_sec) * 1000000000LL +
+		(now.tv_nsec - start->tv_nsec);
+	tm->ns += ns;
+	tm->last = ns;
+	tm->calls++;
+}
+
+/*
+ * Memory held by the rows: their text and renders in the arena, the
+ * row blocks with the block index, and the render slots.
+ */
+size_t stats_row_memory()
+{
+	return E.doc->arena.total +
+		sizeof(struct row_block) * E.doc->nblocks +
+		(sizeof(struct row_block *) + sizeof(int)) * E.doc->blockcap +
+		sizeof(struct erender) * E.doc->rendercap;
+}
+
+/*
+ * Fill buf with the one-line summary shown in the message bar: the
+ * last frame's draw and refresh times and bytes written, system calls
+ * per key of the last batch of keys, allocations and row memory.
+ */
+void stats_line(char *buf, size_t size)
+{
+	struct editor_stats *st = &E.stats;
+	snprintf(buf, size,
+		"draw %.2fms frame %.2fms %ldB | %.1f sys/key | "
+		"%lld allocs | rows %.1fMB",
+		st->draw.last / 1e6, st->refresh.last / 1e6,
+		st->lastwritten, st->keysyscalls, st->allocs,
+		st->rowmem / 1048576.0);
+}
+
+void stats_timer_dump(char *name, struct stats_timer *tm)
+{
+	fprintf(stderr, "%-22s %10.3f ms %8ld calls %10.3f ms avg\n",
+		name, tm->ns / 1e6, tm->calls,
+		tm->calls ? tm->ns / 1e6 / tm->calls : 0.0);
+}
+
+/*
+ * Print the totals to standard error at exit, once the terminal is
+ * back to normal.
+ */
+void stats_dump()
+{
+	struct editor_stats *st = &E.stats;
+
+	stats_timer_dump("editor_open", &st->open);
+	stats_timer_dump("editor_update_row", &st->update);
+	stats_timer_dump("editor_draw_rows", &st->draw);
+	stats_timer_dump("editor_refresh_screen", &st->refresh);
+	fprintf(stderr, "%-22s %ld frames, %lld bytes, %.0f bytes/frame\n",
+		"output", st->frames, st->written,
+		st->frames ? (double)st->written / st->frames : 0.0);
+	fprintf(stderr, "%-22s %lld syscalls, %ld keys, "
+		"%.1f syscalls/key last\n",
+		"input", st->syscalls, st->keys, st->keysyscalls);
+	fprintf(stderr, "%-22s %lld allocations, %ld heap blocks, "
+		"peak %zu bytes\n",
+		"rows", st->allocs, st->heapblocks, st->peakrowmem);
+}
+
 void die(const char *s)
 {
 	write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -104,41 +677,132 @@ void die(const char *s)
 
 void disable_raw_mode()
 {
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
+	if (tcsetattr(E.ttyfd, TCSAFLUSH, &E.orig_termios) == -1) {
 		die("tcsetattr");
 	}
 }
 
+/*
+ * Rows point into a mapping of the file, and once the file is cut
+ * shorter than the mapping, touching a page past its new end raises
+ * SIGBUS in whichever thread did it.  The rows cannot be recovered from
+ * there, so the terminal is restored and the editor exits with a
+ * message instead of being killed in raw mode.  Only async-signal-safe
+ * calls are made.
+ */
+void editor_sigbus(int sig)
+{
+	static const char msg[] =
+		"kilo: the file was truncated while it was mapped\n";
+	(void)sig;
+	write(E.outfd, "\x1b[2J\x1b[H", 7);
+	tcsetattr(E.ttyfd, TCSAFLUSH, &E.orig_termios);
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	_exit(1);
+}
+
 void enable_raw_mode()
 {
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
+	if (tcgetattr(E.ttyfd, &E.orig_termios) == -1) {
 		die("tcgetattr");
 	}
 	atexit(disable_raw_mode);
 
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editor_sigbus;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGBUS, &sa, NULL) == -1) {
+		die("sigaction");
+	}
+
 	struct termios raw = E.orig_termios;
 	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 	raw.c_oflag &= ~(OPOST);
 	raw.c_cflag &= ~(CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	/*
+	 * read() never blocks: the editor waits for input in poll(),
+	 * see editor_read_byte().
+	 */
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+	if (tcsetattr(E.ttyfd, TCSAFLUSH, &raw) == -1) {
 		die("tcsetattr");
 	}
 }
 
-int editor_read_key()
+/*
+ * Terminal input is read in bulk into E.inbuf, as much as is
+ * available in one read(), and handed out from there a byte at a
+ * time.  Waiting happens in poll(), so an idle editor sleeps instead
+ * of waking up every VTIME, and a whole escape sequence or paste costs
+ * a single system call.
+ *
+ * Wait up to timeout milliseconds (forever if negative) for input.
+ * Returns 1 if some is waiting to be read.
+ */
+int editor_wait_input(int timeout)
 {
-	int nread;
-	char c;
+	if (E.inpos < E.inlen) {
+		return 1;
+	}
+
+	struct pollfd pfd = { E.ttyfd, POLLIN, 0 };
+	int n;
+	while ((n = poll(&pfd, 1, timeout)) == -1) {
+		E.stats.syscalls++;
+		if (errno != EINTR) {
+			die("poll");
+		}
+	}
+	E.stats.syscalls++;
+	return n > 0;
+}
+
+/*
+ * Store the next input byte in *c.  Returns 0 if none arrived within
+ * timeout milliseconds.
+ */
+int editor_read_byte(char *c, int timeout)
+{
+	if (E.inpos == E.inlen) {
+		if (!editor_wait_input(timeout)) {
+			return 0;
+		}
 
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) {
+		ssize_t nread = read(E.ttyfd, E.inbuf, sizeof(E.inbuf));
+		E.stats.syscalls++;
+		if (nread == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return 0;
+			}
 			die("read");
 		}
+		if (nread == 0) {
+			/*
+			 * poll() said the terminal was readable, so
+			 * this is a hangup rather than a timeout.
+			 */
+			die("read");
+		}
+		E.inpos = 0;
+		E.inlen = nread;
+	}
+
+	*c = E.inbuf[E.inpos++];
+	return 1;
+}
+
+int editor_read_key()
+{
+	char c;
+
+	while (!editor_read_byte(&c, -1)) {
+		;
 	}
+	E.stats.keys++;
 
 	/*
 	 * Detect the arrow keys.  Arrow keys are sent in the form of
@@ -160,16 +824,17 @@ int editor_read_key()
 	if (c == '\x1b') {
 		char seq[3];
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+		if (!editor_read_byte(&seq[0], KILO_ESC_TIMEOUT)) {
 			return '\x1b';
 		}
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+		if (!editor_read_byte(&seq[1], KILO_ESC_TIMEOUT)) {
 			return '\x1b';
 		}
 
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+				if (!editor_read_byte(&seq[2],
+							KILO_ESC_TIMEOUT)) {
 					return '\x1b';
 				}
 				if (seq[2] == '~') {
@@ -231,12 +896,12 @@ int get_cursor_position(int *rows, int *cols)
 	 * of 6 to ask for the cursor position.  Then we can read the
 	 * reply from STDIN.
 	 */
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+	if (write(E.outfd, "\x1b[6n", 4) != 4) {
 		return -1;
 	}
 
 	while (i < sizeof(buf) - 1) {
-		if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+		if (!editor_read_byte(&buf[i], KILO_ESC_TIMEOUT)) {
 			break;
 		}
 		if (buf[i] == 'R') {
@@ -260,7 +925,7 @@ int get_window_size(int *rows, int *cols)
 {
 	struct winsize ws;
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+	if (ioctl(E.outfd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 		/*
 		 * The C command (Cursor Forward) moves the cursor to
 		 * the right, and the B command (Cursor Down) moves the
@@ -268,7 +933,7 @@ int get_window_size(int *rows, int *cols)
 		 * that the cursor reaches the right and bottom edges
 		 * of the screen.
 		 */
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+		if (write(E.outfd, "\x1b[999C\x1b[999B", 12) != 12) {
 			return -1;
 		}
 		return get_cursor_position(rows, cols);
@@ -279,246 +944,3767 @@ int get_window_size(int *rows, int *cols)
 	}
 }
 
-int editor_row_cx_to_rx(erow *row, int cx) {
-	int rx = 0;
-	int i;
-	for (i = 0; i < cx; i++) {
-		if (row->chars[i] == '\t') {
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		}
-		rx++;
+/*
+ * Event loop.
+ *
+ * Everything the editor waits for goes through a single poll(): the
+ * terminal, the SIGWINCH self-pipe, and whatever is registered here
+ * (the loader's notification pipe, a file being read in chunks).  A
+ * handful of descriptors is all there ever is, which poll() handles
+ * as cheaply as epoll or kqueue would, and portably.
+ */
+void editor_watch(int fd, int (*handler)())
+{
+	if (E.nwatches == KILO_MAX_WATCHES) {
+		errno = EMFILE;
+		die("editor_watch");
 	}
-	return rx;
+	E.watches[E.nwatches].fd = fd;
+	E.watches[E.nwatches].handler = handler;
+	E.nwatches++;
 }
 
-void editor_update_row(erow *row)
+void editor_unwatch(int fd)
 {
-	int tabs = 0;
 	int i;
-	for (i = 0; i < row->size; i++) {
-		if (row->chars[i] == '\t') {
-			tabs++;
-		}
-	}
-
-	free(row->render);
-	row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-
-	int j;
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0) {
-				row->render[idx++] = ' ';
-			}
-		} else {
-			row->render[idx++] = row->chars[j];
+	for (i = 0; i < E.nwatches; i++) {
+		if (E.watches[i].fd == fd) {
+			E.watches[i] = E.watches[--E.nwatches];
+			return;
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
 }
 
-void editor_append_row(char *s, size_t len)
+/*
+ * Row arena.
+ */
+void *arena_alloc(struct arena *a, size_t n)
 {
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+	struct arena_block *b = a->head;
 
-	int at = E.numrows;
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	a->total += n;
+	E.stats.allocs++;
+	if (b && b->size - b->used >= n) {
+		void *p = &b->data[b->used];
+		b->used += n;
+		return p;
+	}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editor_update_row(&E.row[at]);
+	/*
+	 * Requests bigger than a quarter block get a block of their
+	 * own, linked in behind the current one so that the space left
+	 * in it is not wasted.
+	 */
+	size_t size = n > ARENA_BLOCK_SIZE / 4 ? n : ARENA_BLOCK_SIZE;
+	struct arena_block *nb = malloc(sizeof(*nb) + size);
+	if (nb == NULL) {
+		die("malloc");
+	}
+	E.stats.heapblocks++;
+	nb->size = size;
+	nb->used = n;
+	if (b && size != ARENA_BLOCK_SIZE) {
+		nb->next = b->next;
+		b->next = nb;
+	} else {
+		nb->next = b;
+		a->head = nb;
+	}
+	return nb->data;
+}
 
-	E.numrows++;
+void *arena_alloc_aligned(struct arena *a, size_t n, size_t align)
+{
+	char *p = arena_alloc(a, n + align - 1);
+	return (void *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b = a->head;
+	while (b) {
+		struct arena_block *next = b->next;
+		free(b);
+		b = next;
+	}
+	a->head = NULL;
+	a->total = 0;
+}
+
+/*
+ * UTF-8.
+ *
+ * Widths are given per byte, looking only at the byte and the ones
+ * after it, so that any run of a row can be measured on its own: a
+ * valid sequence takes the display width of its code point at its
+ * lead byte, continuation bytes take none, and a lead byte that does
+ * not start a valid sequence is drawn as '?' in one column.
+ */
+struct width_range {
+	int first;
+	int last;
+};
+
+/*
+ * Combining and other zero-width characters, for the common scripts.
+ */
+static const struct width_range zero_width[] = {
+	{0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD},
+	{0x05BF, 0x05BF}, {0x05C1, 0x05C2}, {0x05C4, 0x05C5},
+	{0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F},
+	{0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+	{0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+	{0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3},
+	{0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+	{0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+	{0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC},
+	{0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+	{0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+	{0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+	{0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+	{0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+	{0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A},
+	{0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+	{0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F},
+	{0xE0100, 0xE01EF}
+};
+
+/*
+ * East Asian Wide and Fullwidth characters, and the emoji terminals
+ * draw two columns wide.
+ */
+static const struct width_range double_width[] = {
+	{0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A},
+	{0x23E9, 0x23EC}, {0x23F0, 0x23F0}, {0x23F3, 0x23F3},
+	{0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653},
+	{0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+	{0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+	{0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA},
+	{0x26F2, 0x26F3}, {0x26F5, 0x26F5}, {0x26FA, 0x26FA},
+	{0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+	{0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E},
+	{0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+	{0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C},
+	{0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x3029},
+	{0x302E, 0x303E}, {0x3041, 0x3098}, {0x309B, 0x33FF},
+	{0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+	{0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+	{0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+	{0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF},
+	{0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+	{0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202},
+	{0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251},
+	{0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335},
+	{0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+	{0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+	{0x1F3F8, 0x1F3FA}, {0x1F400, 0x1F43E}, {0x1F440, 0x1F440},
+	{0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+	{0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+	{0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5},
+	{0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7},
+	{0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+	{0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+	{0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+#define WIDTH_RANGES(r) (sizeof(r) / sizeof((r)[0]))
+
+int width_in(const struct width_range *r, int n, int cp)
+{
+	int lo = 0;
+	int hi = n - 1;
+
+	if (cp < r[0].first || cp > r[n - 1].last) {
+		return 0;
+	}
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (cp > r[mid].last) {
+			lo = mid + 1;
+		} else if (cp < r[mid].first) {
+			hi = mid - 1;
+		} else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Display width of a code point.  For the BMP, the range tables are
+ * searched once per code point and the answer is kept in bmp_width at
+ * two bits each, so that text in a non-Latin script costs a table load
+ * per character rather than a search.  Entries hold width + 1, so that
+ * zero means not looked up yet.
+ */
+int utf8_width(int cp)
+{
+	static unsigned char bmp_width[0x10000 / 4];
+
+	if (cp < 0x300) {
+		return 1;
+	}
+	if (cp >= 0x10000) {
+		if (width_in(zero_width, WIDTH_RANGES(zero_width), cp)) {
+			return 0;
+		}
+		return 1 + width_in(double_width, WIDTH_RANGES(double_width),
+				cp);
+	}
+
+	int shift = (cp & 3) * 2;
+	int w = (bmp_width[cp >> 2] >> shift) & 3;
+	if (w == 0) {
+		if (width_in(zero_width, WIDTH_RANGES(zero_width), cp)) {
+			w = 1;
+		} else {
+			w = 2 + width_in(double_width,
+					WIDTH_RANGES(double_width), cp);
+		}
+		bmp_width[cp >> 2] |= w << shift;
+	}
+	return w - 1;
+}
+
+/*
+ * Decode the sequence whose lead byte is at p, reading no further
+ * than limit.  Returns its length and sets *cp, or returns 0 if p does
+ * not start a valid sequence.
+ */
+int utf8_decode(char *p, char *limit, int *cp)
+{
+	unsigned char c = *p;
+	int len;
+	int min;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c >= 0xC2 && c <= 0xDF) {
+		len = 2;
+		min = 0x80;
+		*cp = c & 0x1F;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		len = 3;
+		min = 0x800;
+		*cp = c & 0x0F;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		len = 4;
+		min = 0x10000;
+		*cp = c & 0x07;
+	} else {
+		return 0;
+	}
+	if (limit - p < len) {
+		return 0;
+	}
+
+	for (int i = 1; i < len; i++) {
+		unsigned char cc = p[i];
+		if ((cc & 0xC0) != 0x80) {
+			return 0;
+		}
+		*cp = (*cp << 6) | (cc & 0x3F);
+	}
+	if (*cp < min || *cp > 0x10FFFF ||
+			(*cp >= 0xD800 && *cp <= 0xDFFF)) {
+		return 0;
+	}
+	return len;
+}
+
+int utf8_is_cont(char c)
+{
+	return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+/*
+ * Measure the character at p: stores its width in *w and returns its
+ * length in bytes, which is 1 for a continuation or invalid byte.
+ * *valid is cleared for a byte that is not part of a valid sequence.
+ */
+int utf8_char(char *p, char *limit, int *w, int *valid)
+{
+	unsigned char c = *p;
+	int cp;
+
+	*valid = 1;
+	if (c < 0x80) {
+		*w = 1;
+		return 1;
+	}
+	if ((c & 0xC0) == 0x80) {
+		*w = 0;
+		*valid = 0;
+		return 1;
+	}
+	int len = utf8_decode(p, limit, &cp);
+	if (len == 0) {
+		*w = 1;
+		*valid = 0;
+		return 1;
+	}
+	*w = utf8_width(cp);
+	return len;
+}
+
+/*
+ * Length of the run of ASCII bytes at the start of p.  The bytes are
+ * tested a word at a time, four words per iteration so that the loop
+ * body can become a vector compare; most lines of a log never leave
+ * it.
+ */
+size_t utf8_ascii_span(char *p, size_t n)
+{
+	const uint64_t high = 0x8080808080808080ULL;
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		uint64_t w[4];
+		memcpy(w, &p[i], sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3]) & high) {
+			break;
+		}
+	}
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, &p[i], sizeof(w));
+		if (w & high) {
+			break;
+		}
+	}
+	while (i < n && !(p[i] & 0x80)) {
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Number of columns taken by [p, end), which holds no tabs.  limit is
+ * the end of the row: a character that starts before end is measured
+ * whole even if it ends after it.
+ */
+int utf8_columns(char *p, char *end, char *limit)
+{
+	int cols = 0;
+
+	while (p < end) {
+		size_t n = utf8_ascii_span(p, end - p);
+		cols += n;
+		p += n;
+		if (p < end) {
+			int w;
+			int valid;
+			p += utf8_char(p, limit, &w, &valid);
+			cols += w;
+		}
+	}
+	return cols;
+}
+
+/*
+ * Tabs are located with memchr() rather than by testing every byte.
+ * The C library ships vectorized memchr() implementations for the
+ * machine it runs on, so the runs of text between tabs are skipped
+ * (and copied, with memcpy()) many bytes at a time.
+ *
+ * Return the render column reached by walking from p to end, when p
+ * itself is at render column rx.  limit is the end of the row.
+ */
+int editor_chars_to_rx(char *p, char *end, char *limit, int rx)
+{
+	char *tab;
+
+	while ((tab = memchr(p, '\t', end - p)) != NULL) {
+		rx += utf8_columns(p, tab, limit);
+		rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+		p = tab + 1;
+	}
+	return rx + utf8_columns(p, end, limit);
+}
+
+int editor_row_cx_to_rx(erow *row, int cx) {
+	struct rx_cache *c = &E.rxc;
+
+	/*
+	 * Long rows carry their own marks, and without tabs or UTF-8
+	 * the column is the byte index.
+	 */
+	if (row->size >= KILO_WINDOW_ROW) {
+		struct erender r = editor_row_render(row);
+		if (r.marks) {
+			int k = cx / KILO_RX_MARK_STEP;
+			return editor_chars_to_rx(
+					&row->chars[k * KILO_RX_MARK_STEP],
+					&row->chars[cx],
+					&row->chars[row->size], r.marks[k]);
+		}
+		/*
+		 * A long row with tabs or UTF-8 always has marks.
+		 */
+		return cx;
+	}
+
+	if (c->chars != row->chars || c->size != row->size) {
+		c->chars = row->chars;
+		c->size = row->size;
+		c->cx = 0;
+		c->rx = 0;
+		c->nmarks = 0;
+	}
+	if (c->nmarks == 0) {
+		if (c->markcap == 0) {
+			c->markcap = 16;
+			c->marks = malloc(sizeof(int) * c->markcap);
+		}
+		c->marks[c->nmarks++] = 0;
+	}
+
+	int from;
+	int rx;
+	if (cx >= c->cx) {
+		from = c->cx;
+		rx = c->rx;
+	} else if (!memchr(&row->chars[cx], '\t', c->cx - cx) &&
+			utf8_ascii_span(&row->chars[cx], c->cx - cx) ==
+			(size_t)(c->cx - cx)) {
+		c->rx -= c->cx - cx;
+		c->cx = cx;
+		return c->rx;
+	} else {
+		int k = cx / KILO_RX_MARK_STEP;
+		if (k >= c->nmarks) {
+			k = c->nmarks - 1;
+		}
+		from = k * KILO_RX_MARK_STEP;
+		rx = c->marks[k];
+	}
+
+	while (from < cx) {
+		int to = (from / KILO_RX_MARK_STEP + 1) * KILO_RX_MARK_STEP;
+		if (to > cx) {
+			to = cx;
+		}
+		rx = editor_chars_to_rx(&row->chars[from], &row->chars[to],
+				&row->chars[row->size], rx);
+		from = to;
+
+		if (from == c->nmarks * KILO_RX_MARK_STEP) {
+			if (c->nmarks == c->markcap) {
+				c->markcap *= 2;
+				c->marks = realloc(c->marks,
+						sizeof(int) * c->markcap);
+			}
+			c->marks[c->nmarks++] = rx;
+		}
+	}
+
+	c->cx = cx;
+	c->rx = rx;
+	return rx;
+}
+
+/*
+ * Slot in E.doc->renders for the row.  A row being rendered again keeps
+ * its slot.
+ */
+unsigned int editor_render_slot(erow *row)
+{
+	unsigned int slot = row->info >> ROW_SLOT_SHIFT;
+	if (slot == 0) {
+		if (E.doc->nrenders == 0) {
+			E.doc->nrenders = 1;
+		}
+		if (E.doc->nrenders >= E.doc->rendercap) {
+			E.doc->rendercap = E.doc->rendercap ?
+				E.doc->rendercap * 2 : 64;
+			E.doc->renders = realloc(E.doc->renders,
+					sizeof(struct erender) *
+					E.doc->rendercap);
+			if (E.doc->renders == NULL) {
+				die("realloc");
+			}
+		}
+		slot = E.doc->nrenders++;
+	}
+	return slot;
+}
+
+void editor_update_row(erow *row)
+{
+	char *end = &row->chars[row->size];
+	char *p;
+	char *tab;
+
+	int tabs = 0;
+	for (p = row->chars; (tab = memchr(p, '\t', end - p)); p = tab + 1) {
+		tabs++;
+	}
+
+	unsigned int flags = row->info & (ROW_MAPPED | ROW_HL_VALID |
+			ROW_HL_OPEN | ROW_HL_GUESS);
+	if (utf8_ascii_span(row->chars, row->size) != (size_t)row->size) {
+		flags |= ROW_UTF8;
+	}
+
+	/*
+	 * Without tabs or UTF-8 the render would be a byte-for-byte
+	 * copy of chars, so the row just shares it.  Short rows with
+	 * UTF-8 are measured from chars while they are drawn.
+	 */
+	int plain = tabs == 0 && !(flags & ROW_UTF8);
+	if (plain || (row->size < KILO_WINDOW_ROW && flags & ROW_UTF8)) {
+		row->info = flags;
+		return;
+	}
+
+	unsigned int slot = editor_render_slot(row);
+	struct erender *r = &E.doc->renders[slot];
+	row->info = (slot << ROW_SLOT_SHIFT) | flags;
+
+	/*
+	 * Buffers replaced by a new render stay in the arena until the
+	 * file is closed.
+	 */
+	if (row->size >= KILO_WINDOW_ROW) {
+		int n = row->size / KILO_RX_MARK_STEP + 1;
+		r->render = NULL;
+		r->rsize = 0;
+		r->marks = arena_alloc_aligned(&E.doc->arena, sizeof(int) * n,
+				sizeof(int));
+		r->nmarks = n;
+
+		r->marks[0] = 0;
+		for (int k = 1; k < n; k++) {
+			p = &row->chars[(k - 1) * KILO_RX_MARK_STEP];
+			r->marks[k] = editor_chars_to_rx(p,
+					p + KILO_RX_MARK_STEP, end,
+					r->marks[k - 1]);
+		}
+		return;
+	}
+
+	r->marks = NULL;
+	r->nmarks = 0;
+	r->render = arena_alloc(&E.doc->arena,
+			row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+
+	int idx = 0;
+	for (p = row->chars; (tab = memchr(p, '\t', end - p)); p = tab + 1) {
+		memcpy(&r->render[idx], p, tab - p);
+		idx += tab - p;
+
+		int pad = KILO_TAB_STOP - (idx % KILO_TAB_STOP);
+		memset(&r->render[idx], ' ', pad);
+		idx += pad;
+	}
+	memcpy(&r->render[idx], p, end - p);
+	idx += end - p;
+
+	r->render[idx] = '\0';
+	r->rsize = idx;
+}
+
+/*
+ * Mark the render of row at as stale after its chars changed.  It is
+ * rebuilt by editor_row_render() the next time it is needed.
+ */
+void editor_invalidate_row(int at)
+{
+	erow *row = editor_row_at(at);
+	row->info |= ROW_DIRTY;
+	if (E.rxc.chars == row->chars) {
+		E.rxc.chars = NULL;
+	}
+	editor_hl_update(at);
+}
+
+/*
+ * Return the up-to-date render of a row.
+ */
+struct erender editor_row_render(erow *row)
+{
+	if (row->info & ROW_DIRTY) {
+		struct timespec t;
+		stats_start(&t);
+		editor_update_row(row);
+		stats_stop(&E.stats.update, &t);
+	}
+
+	struct erender r = {row->chars, row->size, NULL, 0};
+	unsigned int slot = row->info >> ROW_SLOT_SHIFT;
+	if (slot) {
+		r = E.doc->renders[slot];
+	}
+	return r;
+}
+
+/*
+ * Index of the block that holds row at.
+ */
+int editor_row_block(int at)
+{
+	int i = at / KILO_ROW_BLOCK;
+	if (i < E.doc->nblocks && E.doc->blockstart[i] <= at &&
+			at < E.doc->blockstart[i] + E.doc->blocks[i]->n) {
+		return i;
+	}
+
+	int lo = 0;
+	int hi = E.doc->nblocks;
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (E.doc->blockstart[mid] <= at) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+erow *editor_row_at(int at)
+{
+	int i = editor_row_block(at);
+	return &E.doc->blocks[i]->rows[at - E.doc->blockstart[i]];
+}
+
+/*
+ * Make sure the block index has room for at least n rows' worth of
+ * full blocks, without changing the number of rows in use.
+ */
+void editor_reserve_rows(int n)
+{
+	int cap = n / KILO_ROW_BLOCK + 1;
+	if (cap <= E.doc->blockcap) {
+		return;
+	}
+	E.doc->blocks = realloc(E.doc->blocks,
+		sizeof(struct row_block *) * cap);
+	E.doc->blockstart = realloc(E.doc->blockstart, sizeof(int) * cap);
+	if (E.doc->blocks == NULL || E.doc->blockstart == NULL) {
+		die("realloc");
+	}
+	E.doc->blockcap = cap;
+}
+
+/*
+ * Insert an empty block at index i of the block index, starting at
+ * row start.
+ */
+struct row_block *editor_insert_block(int i, int start)
+{
+	struct row_block *b = malloc(sizeof(*b));
+	if (b == NULL) {
+		die("malloc");
+	}
+	b->n = 0;
+
+	if (E.doc->nblocks == E.doc->blockcap) {
+		int cap = E.doc->blockcap ? E.doc->blockcap * 2 : 16;
+		editor_reserve_rows((cap - 1) * KILO_ROW_BLOCK);
+	}
+	memmove(&E.doc->blocks[i + 1], &E.doc->blocks[i],
+			sizeof(struct row_block *) * (E.doc->nblocks - i));
+	memmove(&E.doc->blockstart[i + 1], &E.doc->blockstart[i],
+			sizeof(int) * (E.doc->nblocks - i));
+	E.doc->blocks[i] = b;
+	E.doc->blockstart[i] = start;
+	E.doc->nblocks++;
+	return b;
+}
+
+/*
+ * Shift the start of every block after block i by delta rows.
+ */
+void editor_shift_blocks(int i, int delta)
+{
+	for (i++; i < E.doc->nblocks; i++) {
+		E.doc->blockstart[i] += delta;
+	}
+}
+
+/*
+ * Add a row at the end and return it, zeroed and waiting for its
+ * first render.
+ */
+erow *editor_new_row()
+{
+	struct row_block *b = E.doc->nblocks ?
+		E.doc->blocks[E.doc->nblocks - 1] : NULL;
+	if (b == NULL || b->n == KILO_ROW_BLOCK) {
+		b = editor_insert_block(E.doc->nblocks, E.doc->numrows);
+	}
+
+	erow *row = &b->rows[b->n++];
+	memset(row, 0, sizeof(*row));
+	row->info = ROW_DIRTY;
+	E.doc->numrows++;
+	return row;
+}
+
+/*
+ * Insert a row before row at and return it, zeroed and waiting for
+ * its first render.  A full block is split in half first.
+ */
+erow *editor_new_row_at(int at)
+{
+	if (at >= E.doc->numrows) {
+		return editor_new_row();
+	}
+
+	int i = editor_row_block(at);
+	struct row_block *b = E.doc->blocks[i];
+	if (b->n == KILO_ROW_BLOCK) {
+		int half = KILO_ROW_BLOCK / 2;
+		struct row_block *nb = editor_insert_block(i + 1,
+				E.doc->blockstart[i] + half);
+		memcpy(nb->rows, &b->rows[half], sizeof(erow) * (b->n - half));
+		nb->n = b->n - half;
+		b->n = half;
+		if (at >= E.doc->blockstart[i + 1]) {
+			i++;
+			b = nb;
+		}
+	}
+
+	int k = at - E.doc->blockstart[i];
+	memmove(&b->rows[k + 1], &b->rows[k], sizeof(erow) * (b->n - k));
+	b->n++;
+	editor_shift_blocks(i, 1);
+
+	erow *row = &b->rows[k];
+	memset(row, 0, sizeof(*row));
+	row->info = ROW_DIRTY;
+	E.doc->numrows++;
+	return row;
+}
+
+/*
+ * Insert a row holding a copy of s before row at.
+ */
+void editor_insert_row(int at, char *s, size_t len)
+{
+	erow *row = editor_new_row_at(at);
+
+	row->size = len;
+	row->chars = arena_alloc(&E.doc->arena, len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	if (at < E.doc->nmapped) {
+		E.doc->nowned++;
+	}
+	editor_hl_shift(at, 1);
+	editor_hl_update(at);
+}
+
+/*
+ * Remove row at.  Its text stays in the arena or the mapping; a block
+ * left empty is dropped from the index.
+ */
+void editor_del_row(int at)
+{
+	if (at < 0 || at >= E.doc->numrows) {
+		return;
+	}
+
+	int i = editor_row_block(at);
+	struct row_block *b = E.doc->blocks[i];
+	int k = at - E.doc->blockstart[i];
+	erow *row = &b->rows[k];
+	if (E.rxc.chars == row->chars) {
+		E.rxc.chars = NULL;
+	}
+	if (row->info & ROW_MAPPED) {
+		if (at == E.doc->nmapped - 1) {
+			E.doc->nmapped--;
+		} else {
+			E.doc->nowned++;
+		}
+	}
+
+	memmove(&b->rows[k], &b->rows[k + 1], sizeof(erow) * (b->n - k - 1));
+	b->n--;
+	editor_shift_blocks(i, -1);
+	E.doc->numrows--;
+
+	if (b->n == 0) {
+		free(b);
+		E.doc->nblocks--;
+		memmove(&E.doc->blocks[i], &E.doc->blocks[i + 1],
+				sizeof(struct row_block *) *
+				(E.doc->nblocks - i));
+		memmove(&E.doc->blockstart[i], &E.doc->blockstart[i + 1],
+				sizeof(int) * (E.doc->nblocks - i));
+	}
+	editor_hl_shift(at, -1);
+	if (at < E.doc->numrows) {
+		editor_hl_update(at);
+	}
+}
+
+void editor_append_row(char *s, size_t len)
+{
+	erow *row = editor_new_row();
+
+	row->size = len;
+	row->chars = arena_alloc(&E.doc->arena, len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+}
+
+/*
+ * Append a row whose text lives in the file mapping.  No copy is
+ * made; see editor_row_own() for when the row needs to change.
+ */
+void editor_append_mapped_row(char *s, size_t len)
+{
+	erow *row = editor_new_row();
+
+	row->size = len;
+	row->chars = s;
+	row->info |= ROW_MAPPED;
+	E.doc->nmapped++;
+}
+
+/*
+ * Give a mapped row a private copy of its text, so that it can
+ * be modified without touching the mapping.  Rows that already own
+ * their text are left alone.
+ */
+void editor_row_own(erow *row)
+{
+	if (!(row->info & ROW_MAPPED)) {
+		return;
+	}
+
+	char *chars = arena_alloc(&E.doc->arena, row->size + 1);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	row->chars = chars;
+	row->info &= ~ROW_MAPPED;
+	E.doc->nowned++;
+}
+
+/*
+ * Syntax highlighting.
+ *
+ * Highlighting a row only takes whether a multi-line comment is open
+ * at its start, which is the state at the end of the row before.
+ * That state is kept in each row's info once known, so the classes of
+ * a row can be worked out whenever it is drawn, and are not stored.
+ * States are found lazily, from the nearest row above that has one,
+ * and that search gives up after KILO_HL_SYNC rows and assumes no
+ * comment is open: a jump into the middle of a huge file then costs a
+ * screenful plus at most KILO_HL_SYNC rows, never a scan from the
+ * top.  States that rest on such a guess are marked as guesses and
+ * put right from the top while the editor is idle.
+ */
+#ifndef KILO_HL_SYNC
+#define KILO_HL_SYNC 1024
+#endif
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+	"switch", "if", "while", "for", "break", "continue", "return",
+	"else", "struct", "union", "typedef", "static", "enum", "class",
+	"case", "default", "do", "goto", "sizeof", "const", "volatile",
+	"extern", "inline", "#include", "#define", "#ifdef", "#ifndef",
+	"#endif", "#if", "#else",
+
+	"int|", "long|", "double|", "float|", "char|", "unsigned|",
+	"signed|", "void|", "short|", "size_t|", "ssize_t|", "off_t|",
+	NULL
+};
+
+struct editor_syntax HLDB[] = {
+	{
+		"c",
+		C_HL_extensions,
+		C_HL_keywords,
+		"//", "/*", "*/",
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+	},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+struct editor_syntax *editor_select_syntax(char *filename)
+{
+	char *ext = strrchr(filename, '.');
+
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+		struct editor_syntax *s = &HLDB[j];
+		for (char **m = s->filematch; *m; m++) {
+			int is_ext = (*m)[0] == '.';
+			if ((is_ext && ext && strcmp(ext, *m) == 0) ||
+					(!is_ext && strstr(filename, *m))) {
+				return s;
+			}
+		}
+	}
+	return NULL;
+}
+
+int is_separator(int c)
+{
+	return isspace((unsigned char)c) || c == '\0' ||
+		strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/*
+ * Whether the size - i bytes at p[i] start with s.
+ */
+int hl_starts(char *p, int i, int size, char *s, int len)
+{
+	return len && size - i >= len && memcmp(&p[i], s, len) == 0;
+}
+
+/*
+ * Highlight row, which starts inside a multi-line comment if open is
+ * set.  The classes go to hl, one per byte of chars, unless hl is NULL
+ * and only the state is wanted.  Returns whether a multi-line comment
+ * is still open at the end of the row.
+ */
+int editor_hl_row(erow *row, int open, unsigned char *hl)
+{
+	struct editor_syntax *syntax = E.doc->syntax;
+	char *p = row->chars;
+	int size = row->size;
+
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	int prev_sep = 1;
+	int in_string = 0;
+	int in_comment = open;
+	int prev_hl = HL_NORMAL;
+	int i = 0;
+
+	if (hl) {
+		memset(hl, HL_NORMAL, size);
+	}
+	while (i < size) {
+		char c = p[i];
+
+		if (!in_string && !in_comment &&
+				hl_starts(p, i, size, scs, scs_len)) {
+			if (hl) {
+				memset(&hl[i], HL_COMMENT, size - i);
+			}
+			break;
+		}
+
+		if (mcs_len && mce_len && !in_string) {
+			if (in_comment) {
+				if (hl_starts(p, i, size, mce, mce_len)) {
+					if (hl) {
+						memset(&hl[i], HL_MLCOMMENT,
+							mce_len);
+					}
+					i += mce_len;
+					in_comment = 0;
+					prev_sep = 1;
+					continue;
+				}
+				if (hl) {
+					hl[i] = HL_MLCOMMENT;
+				}
+				i++;
+				continue;
+			} else if (hl_starts(p, i, size, mcs, mcs_len)) {
+				if (hl) {
+					memset(&hl[i], HL_MLCOMMENT, mcs_len);
+				}
+				i += mcs_len;
+				in_comment = 1;
+				continue;
+			}
+		}
+
+		if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+			if (in_string) {
+				if (hl) {
+					hl[i] = HL_STRING;
+				}
+				if (c == '\\' && i + 1 < size) {
+					if (hl) {
+						hl[i + 1] = HL_STRING;
+					}
+					i += 2;
+					continue;
+				}
+				if (c == in_string) {
+					in_string = 0;
+				}
+				i++;
+				prev_sep = 1;
+				continue;
+			} else if (c == '"' || c == '\'') {
+				in_string = c;
+				if (hl) {
+					hl[i] = HL_STRING;
+				}
+				i++;
+				continue;
+			}
+		}
+
+		/*
+		 * Numbers and keywords cannot hide a comment or a quote,
+		 * so they are skipped when only the state is wanted.
+		 */
+		if (hl == NULL) {
+			prev_sep = is_separator(c);
+			i++;
+			continue;
+		}
+
+		if (i > 0) {
+			prev_hl = hl[i - 1];
+		}
+		if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+				((isdigit((unsigned char)c) &&
+				  (prev_sep || prev_hl == HL_NUMBER)) ||
+				 (c == '.' && prev_hl == HL_NUMBER))) {
+			hl[i] = HL_NUMBER;
+			i++;
+			prev_sep = 0;
+			continue;
+		}
+
+		if (prev_sep) {
+			char **kw = syntax->keywords;
+			int j;
+			for (j = 0; kw[j]; j++) {
+				int klen = strlen(kw[j]);
+				int kw2 = kw[j][klen - 1] == '|';
+				if (kw2) {
+					klen--;
+				}
+				if (hl_starts(p, i, size, kw[j], klen) &&
+						(i + klen == size ||
+						 is_separator(p[i + klen]))) {
+					memset(&hl[i], kw2 ? HL_KEYWORD2 :
+						HL_KEYWORD1, klen);
+					i += klen;
+					break;
+				}
+			}
+			if (kw[j] != NULL) {
+				prev_sep = 0;
+				continue;
+			}
+		}
+
+		prev_sep = is_separator(c);
+		i++;
+	}
+	return in_comment;
+}
+
+/*
+ * Keep the state at the end of row, which is row at.
+ */
+void editor_hl_store(erow *row, int at, int open, int guess)
+{
+	row->info = (row->info & ~(ROW_HL_OPEN | ROW_HL_GUESS)) |
+		ROW_HL_VALID | (open ? ROW_HL_OPEN : 0) |
+		(guess ? ROW_HL_GUESS : 0);
+	if (guess && at >= E.doc->hlguessend) {
+		E.doc->hlguessend = at + 1;
+	}
+}
+
+/*
+ * Whether the state of row at, which must be known, is a guess.
+ */
+int editor_hl_guessed(int at)
+{
+	return at >= 0 && (editor_row_at(at)->info & ROW_HL_GUESS) != 0;
+}
+
+/*
+ * Whether a multi-line comment is open at the end of row at, working
+ * it out for the rows in between from the nearest row above whose
+ * state is known.  Rows before the first are outside any comment.
+ * The states worked out from a guess, including the one made when no
+ * state is known within KILO_HL_SYNC rows, are guesses too.
+ */
+int editor_hl_state(int at)
+{
+	int from = at;
+	while (from >= 0 && at - from < KILO_HL_SYNC &&
+			!(editor_row_at(from)->info & ROW_HL_VALID)) {
+		from--;
+	}
+
+	int open = 0;
+	int guess = from >= 0;
+	if (from >= 0 && editor_row_at(from)->info & ROW_HL_VALID) {
+		open = (editor_row_at(from)->info & ROW_HL_OPEN) != 0;
+		guess = (editor_row_at(from)->info & ROW_HL_GUESS) != 0;
+	}
+	for (int i = from + 1; i <= at; i++) {
+		erow *row = editor_row_at(i);
+		open = editor_hl_row(row, open, NULL);
+		editor_hl_store(row, i, open, guess);
+	}
+	return open;
+}
+
+/*
+ * Bring the states after a change to row at up to date: row at and
+ * the rows after it are scanned again, but only until one ends in the
+ * state it had before, since every row after that one is unaffected.
+ * Rows whose state was never worked out stop the scan too; they are
+ * done lazily when they are drawn.
+ */
+void editor_hl_update(int at)
+{
+	if (E.doc->syntax == NULL) {
+		return;
+	}
+
+	int open = at > 0 ? editor_hl_state(at - 1) : 0;
+	int guess = editor_hl_guessed(at - 1);
+	for (int i = at; i < E.doc->numrows; i++) {
+		erow *row = editor_row_at(i);
+		unsigned int old = row->info;
+		open = editor_hl_row(row, open, NULL);
+		editor_hl_store(row, i, open, guess);
+		if (i > at && (!(old & ROW_HL_VALID) ||
+					((old & ROW_HL_OPEN) != 0) == open)) {
+			break;
+		}
+	}
+}
+
+/*
+ * Keep hlexact and hlguessend on the same rows after delta rows were
+ * inserted (or deleted, if negative) at row at.
+ */
+void editor_hl_shift(int at, int delta)
+{
+	if (at < E.doc->hlexact) {
+		E.doc->hlexact += delta;
+	}
+	if (at < E.doc->hlguessend) {
+		E.doc->hlguessend += delta;
+	}
+}
+
+/*
+ * Whether there are guessed states left for editor_hl_idle() to put
+ * right.
+ */
+int editor_hl_pending()
+{
+	return E.doc->syntax && E.doc->hlexact < E.doc->hlguessend &&
+		E.doc->hlexact < E.doc->numrows;
+}
+
+/*
+ * Work out the true states of the next KILO_HL_SYNC rows after
+ * hlexact, replacing any guesses among them.  Called while the editor
+ * is idle until every guess has been put right, which takes a scan of
+ * the file down to the last guessed row, a step at a time so that
+ * keys are still read in between.  Returns 1 if what is on screen
+ * changed.
+ */
+int editor_hl_idle()
+{
+	int at = E.doc->hlexact;
+	int end = at + KILO_HL_SYNC;
+	if (end > E.doc->hlguessend) {
+		end = E.doc->hlguessend;
+	}
+	if (end > E.doc->numrows) {
+		end = E.doc->numrows;
+	}
+
+	int open = at > 0 &&
+		(editor_row_at(at - 1)->info & ROW_HL_OPEN) != 0;
+	int changed = 0;
+	for (; at < end; at++) {
+		erow *row = editor_row_at(at);
+		unsigned int old = row->info & (ROW_HL_VALID | ROW_HL_OPEN);
+		open = editor_hl_row(row, open, NULL);
+		editor_hl_store(row, at, open, 0);
+		if (old != (row->info & (ROW_HL_VALID | ROW_HL_OPEN)) &&
+				at >= E.rowoff - 1 &&
+				at < E.rowoff + E.screenrows) {
+			changed = 1;
+		}
+	}
+	E.doc->hlexact = end;
+	return changed;
+}
+
+/*
+ * Work out the classes of row at into E.hl.  Returns NULL if the row
+ * is not highlighted: rows of KILO_WINDOW_ROW bytes or more are drawn
+ * plain, so that drawing them stays independent of their length, but
+ * their state is still followed for the rows below.
+ */
+unsigned char *editor_hl_draw(int at)
+{
+	erow *row = editor_row_at(at);
+	if (E.doc->syntax == NULL || row->size >= KILO_WINDOW_ROW) {
+		return NULL;
+	}
+
+	if (E.hl == NULL || row->size > E.hlcap) {
+		E.hlcap = row->size > 64 ? row->size * 2 : 128;
+		E.hl = realloc(E.hl, E.hlcap);
+		if (E.hl == NULL) {
+			die("realloc");
+		}
+	}
+	int open = at > 0 ? editor_hl_state(at - 1) : 0;
+	editor_hl_store(row, at, editor_hl_row(row, open, E.hl),
+		editor_hl_guessed(at - 1));
+	return E.hl;
+}
+
+int editor_syntax_to_color(int hl)
+{
+	switch (hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT:
+			return 36;
+		case HL_KEYWORD1:
+			return 33;
+		case HL_KEYWORD2:
+			return 32;
+		case HL_STRING:
+			return 35;
+		case HL_NUMBER:
+			return 31;
+		default:
+			return 39;
+	}
+}
+
+/*
+ * File I/O.
+ */
+
+/*
+ * Files are loaded incrementally, so that time to first paint does not
+ * depend on the size of the file.  Mappings are split by the loader
+ * thread below.  Other files are read here, one KILO_READ_SIZE chunk
+ * whenever the descriptor is readable, so a slow pipe never blocks
+ * the editor.
+ */
+enum editor_eol {
+	EOL_NONE,
+	EOL_LF,
+	EOL_CRLF,
+	EOL_MIXED
+};
+
+int editor_eol_style()
+{
+	if (E.doc->nlf && E.doc->ncrlf) {
+		return EOL_MIXED;
+	}
+	if (E.doc->ncrlf) {
+		return EOL_CRLF;
+	}
+	return E.doc->nlf ? EOL_LF : EOL_NONE;
+}
+
+/*
+ * Rows are shown without their line endings, so the ones other than a
+ * plain LF are named in the message bar.  Returns NULL for the others,
+ * and while the file is still loading.
+ */
+char *editor_eol_name()
+{
+	if (E.doc->loading) {
+		return NULL;
+	}
+	switch (editor_eol_style()) {
+		case EOL_CRLF:
+			return "CRLF";
+		case EOL_MIXED:
+			return "mixed LF and CRLF";
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Called once the whole file has been loaded.
+ */
+void editor_load_done()
+{
+	char *eol = editor_eol_name();
+	if (eol) {
+		editor_set_status_message("%s: %s line endings",
+			E.doc->path ? E.doc->path : "(standard input)", eol);
+	}
+}
+
+/*
+ * Make room for at least n more bytes in E.doc->loadbuf.
+ */
+void editor_grow_loadbuf(size_t n)
+{
+	while (E.doc->loadcap - E.doc->loadlen < n) {
+		size_t cap = E.doc->loadcap ? E.doc->loadcap * 2 :
+			KILO_READ_SIZE;
+		char *buf;
+		if (posix_memalign((void **)&buf, 4096, cap) != 0) {
+			die("posix_memalign");
+		}
+		if (E.doc->loadlen) {
+			memcpy(buf, E.doc->loadbuf, E.doc->loadlen);
+		}
+		free(E.doc->loadbuf);
+		E.doc->loadbuf = buf;
+		E.doc->loadcap = cap;
+	}
+}
+
+/*
+ * Append a row for every line of E.doc->loadbuf completed by the nread
+ * bytes just read into it, and keep the rest of the buffer as the
+ * start of the next line.
+ */
+void editor_split_rows(size_t nread)
+{
+	char *p = E.doc->loadbuf;
+	char *end = &E.doc->loadbuf[E.doc->loadlen + nread];
+	char *nl;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		size_t linelen = nl - p;
+		if (linelen > 0 && p[linelen - 1] == '\r') {
+			E.doc->ncrlf++;
+			while (linelen > 0 && p[linelen - 1] == '\r') {
+				linelen--;
+			}
+		} else {
+			E.doc->nlf++;
+		}
+		editor_append_row(p, linelen);
+		p = nl + 1;
+	}
+
+	E.doc->loadlen = end - p;
+	memmove(E.doc->loadbuf, p, E.doc->loadlen);
+}
+
+/*
+ * Append the incomplete line at the start of E.doc->loadbuf as a row.
+ */
+void editor_append_partial_row()
+{
+	size_t len = E.doc->loadlen;
+	while (len > 0 && E.doc->loadbuf[len - 1] == '\r') {
+		len--;
+	}
+	editor_append_row(E.doc->loadbuf, len);
+}
+
+/*
+ * Drop the oldest rows of a pager, keeping about three quarters of
+ * KILO_PAGER_LIMIT.  Since the arena cannot free single rows, the
+ * rows kept are copied into a new arena and the old one is freed as a
+ * whole; as the copy happens once a quarter of the limit has been
+ * read, each byte read is copied about three times at most.
+ */
+void editor_drop_rows()
+{
+	size_t keep = KILO_PAGER_LIMIT / 4 * 3;
+	size_t bytes = 0;
+	int first = E.doc->numrows;
+	while (first > 0) {
+		erow *row = editor_row_at(first - 1);
+		bytes += row->size + 1 + sizeof(erow);
+		if (bytes > keep) {
+			break;
+		}
+		first--;
+	}
+	if (first == E.doc->numrows) {
+		first = E.doc->numrows - 1;
+	}
+	if (first <= 0) {
+		return;
+	}
+
+	struct row_block **blocks = E.doc->blocks;
+	int *blockstart = E.doc->blockstart;
+	int nblocks = E.doc->nblocks;
+	int numrows = E.doc->numrows;
+	struct arena arena = E.doc->arena;
+
+	E.doc->blocks = NULL;
+	E.doc->blockstart = NULL;
+	E.doc->nblocks = 0;
+	E.doc->blockcap = 0;
+	E.doc->numrows = 0;
+	E.doc->arena.head = NULL;
+	E.doc->arena.total = 0;
+	free(E.doc->renders);
+	E.doc->renders = NULL;
+	E.doc->nrenders = 0;
+	E.doc->rendercap = 0;
+	E.rxc.chars = NULL;
+
+	editor_reserve_rows(numrows - first);
+	for (int i = 0; i < nblocks; i++) {
+		struct row_block *b = blocks[i];
+		for (int j = 0; j < b->n; j++) {
+			if (blockstart[i] + j >= first) {
+				editor_append_row(b->rows[j].chars,
+						b->rows[j].size);
+			}
+		}
+		free(b);
+	}
+	free(blocks);
+	free(blockstart);
+	arena_free(&arena);
+
+	/*
+	 * The view keeps showing the same rows, now at lower indexes;
+	 * shadowrowoff moves along so that this is not taken for a
+	 * scroll.
+	 */
+	E.doc->rowbase += first;
+	E.cy = E.cy > first ? E.cy - first : 0;
+	E.rowoff = E.rowoff > first ? E.rowoff - first : 0;
+	E.shadowrowoff -= first;
+	E.gotorow = E.gotorow > first ? E.gotorow - first : 0;
+	editor_clamp_cx();
+}
+
+/*
+ * Read the next chunk from E.doc->loadfd and append every line completed
+ * by it.  Lines are found with memchr() directly in the read buffer,
+ * and the line ending is stripped and classified in the same pass,
+ * without going through stdio.  The incomplete last line is moved to
+ * the front of the buffer, which grows only for lines longer than it.
+ */
+void editor_read_rows()
+{
+	editor_grow_loadbuf(KILO_READ_SIZE / 2);
+
+	ssize_t nread = read(E.doc->loadfd, &E.doc->loadbuf[E.doc->loadlen],
+			E.doc->loadcap - E.doc->loadlen);
+	E.stats.syscalls++;
+
+	/*
+	 * A read error, such as EISDIR for a directory, ends the load
+	 * like the end of the file does, keeping the rows read so far.
+	 */
+	int failed = 0;
+	if (nread == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
+		editor_set_status_message("Can't read %s: %s",
+			E.doc->path ? E.doc->path : "(standard input)",
+			strerror(errno));
+		failed = 1;
+		nread = 0;
+	}
+
+	editor_split_rows(nread);
+	if (E.doc->pager && E.doc->arena.total + sizeof(erow) * E.doc->numrows >
+			KILO_PAGER_LIMIT) {
+		editor_drop_rows();
+	}
+	if (nread > 0) {
+		return;
+	}
+
+	/*
+	 * End of file: whatever is left is a last line without a
+	 * newline.  A file that is followed keeps it, and its
+	 * descriptor, to pick up where it left off.
+	 */
+	editor_unwatch(E.doc->loadfd);
+	E.doc->loading = 0;
+	if (E.doc->loadlen > 0) {
+		editor_append_partial_row();
+	}
+	if (!failed) {
+		editor_load_done();
+	}
+	if (!failed && E.follow && editor_follow_fd(E.doc->loadfd,
+				lseek(E.doc->loadfd, 0, SEEK_CUR)) == 0) {
+		E.doc->loadfd = -1;
+		return;
+	}
+	close(E.doc->loadfd);
+	E.doc->loadfd = -1;
+	free(E.doc->loadbuf);
+	E.doc->loadbuf = NULL;
+	E.doc->loadlen = 0;
+	E.doc->loadcap = 0;
+}
+
+/*
+ * Loader thread.
+ */
+void loader_publish(struct loader *l, size_t head)
+{
+	__atomic_store_n(&l->head, head, __ATOMIC_RELEASE);
+	write(l->notifyfd[1], "", 1);
+}
+
+void *loader_main(void *arg)
+{
+	struct loader *l = arg;
+	size_t head = 0;
+	size_t published = 0;
+	char *p = l->pos;
+	char c;
+
+	while (p < l->end && !__atomic_load_n(&l->stop, __ATOMIC_RELAXED)) {
+		/*
+		 * When the ring is full, publish what is there and sleep
+		 * until the main thread frees some slots.  waiting is set
+		 * before tail is checked again, and the main thread sets
+		 * tail before it checks waiting, so a wakeup is never
+		 * lost.
+		 */
+		while (head - __atomic_load_n(&l->tail, __ATOMIC_SEQ_CST) ==
+				KILO_LOAD_RING) {
+			if (published != head) {
+				loader_publish(l, head);
+				published = head;
+			}
+			__atomic_store_n(&l->waiting, 1, __ATOMIC_SEQ_CST);
+			if (head - __atomic_load_n(&l->tail, __ATOMIC_SEQ_CST) <
+					KILO_LOAD_RING ||
+					__atomic_load_n(&l->stop, __ATOMIC_SEQ_CST)) {
+				break;
+			}
+			read(l->spacefd[0], &c, 1);
+		}
+		if (__atomic_load_n(&l->stop, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+		char *nl = memchr(p, '\n', l->end - p);
+		size_t linelen = (nl ? nl : l->end) - p;
+		if (nl && linelen > 0 && p[linelen - 1] == '\r') {
+			l->ncrlf++;
+		} else if (nl) {
+			l->nlf++;
+		}
+		while (linelen > 0 && p[linelen - 1] == '\r') {
+			linelen--;
+		}
+		l->ring[head % KILO_LOAD_RING].s = p;
+		l->ring[head % KILO_LOAD_RING].len = linelen;
+		head++;
+		p = nl ? nl + 1 : l->end;
+
+		if (head - published >= l->batch) {
+			loader_publish(l, head);
+			published = head;
+			l->batch = KILO_LOAD_BATCH;
+		}
+	}
+
+	__atomic_store_n(&l->head, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&l->done, 1, __ATOMIC_RELEASE);
+	write(l->notifyfd[1], "", 1);
+	return NULL;
+}
+
+void loader_stop(struct loader *l)
+{
+	editor_unwatch(l->notifyfd[0]);
+	__atomic_store_n(&l->stop, 1, __ATOMIC_SEQ_CST);
+	write(l->spacefd[1], "", 1);
+	pthread_join(l->thread, NULL);
+
+	close(l->notifyfd[0]);
+	close(l->notifyfd[1]);
+	close(l->spacefd[0]);
+	close(l->spacefd[1]);
+	free(l);
+}
+
+/*
+ * Start splitting [p, end) into rows on a new loader thread.  The
+ * first batch is one screenful, so that it can be drawn right away.
+ */
+void editor_start_loader(char *p, char *end)
+{
+	struct loader *l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		die("calloc");
+	}
+	l->pos = p;
+	l->end = end;
+	l->batch = E.screenrows > 0 ? E.screenrows : 1;
+
+	if (pipe(l->notifyfd) == -1 || pipe(l->spacefd) == -1) {
+		die("pipe");
+	}
+	fcntl(l->notifyfd[0], F_SETFL, O_NONBLOCK);
+	fcntl(l->notifyfd[1], F_SETFL, O_NONBLOCK);
+	fcntl(l->spacefd[1], F_SETFL, O_NONBLOCK);
+
+	/*
+	 * The thread starts with signals blocked, so that SIGWINCH is
+	 * always delivered to the main thread.  SIGBUS is left out: it
+	 * is raised by the thread's own reads of the mapping, and a
+	 * blocked fault signal kills the process without running the
+	 * handler.
+	 */
+	sigset_t all;
+	sigset_t old;
+	sigfillset(&all);
+	sigdelset(&all, SIGBUS);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&l->thread, NULL, loader_main, l) != 0) {
+		die("pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	E.doc->loader = l;
+	E.doc->loading = 1;
+}
+
+/*
+ * Append every row the loader has published so far.  The rows and
+ * E.doc->numrows are only ever touched by the main thread, so drawing
+ * never sees a half-added row; the ring is the only shared state.
+ */
+void editor_collect_rows()
+{
+	struct loader *l = E.doc->loader;
+	char buf[256];
+
+	while (read(l->notifyfd[0], buf, sizeof(buf)) > 0) {
+		E.stats.syscalls++;
+	}
+	E.stats.syscalls++;
+
+	/*
+	 * done is read before head: once the loader is seen to be
+	 * done, the head read after it is final.
+	 */
+	int done = __atomic_load_n(&l->done, __ATOMIC_ACQUIRE);
+	size_t head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+	size_t tail = l->tail;
+
+	while (tail != head) {
+		struct loader_slot *slot = &l->ring[tail % KILO_LOAD_RING];
+		editor_append_mapped_row(slot->s, slot->len);
+		tail++;
+	}
+	__atomic_store_n(&l->tail, tail, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&l->waiting, 0, __ATOMIC_SEQ_CST)) {
+		write(l->spacefd[1], "", 1);
+		E.stats.syscalls++;
+	}
+
+	if (done) {
+		E.doc->nlf += l->nlf;
+		E.doc->ncrlf += l->ncrlf;
+		loader_stop(l);
+		E.doc->loader = NULL;
+		E.doc->loading = 0;
+		editor_load_done();
+		if (E.doc->followfd != -1) {
+			editor_follow_map();
+		}
+	}
+}
+
+/*
+ * Event handlers for a file being loaded.  The screen only needs a
+ * refresh if it was not full yet, so that the new rows show up, or
+ * once the load is done, for the message editor_load_done() may leave.
+ */
+int editor_loader_event()
+{
+	int shown = E.doc->numrows < E.rowoff + E.screenrows;
+	editor_collect_rows();
+	return editor_goto_pending() || shown || !E.doc->loading;
+}
+
+int editor_read_event()
+{
+	int shown = E.doc->numrows < E.rowoff + E.screenrows;
+	editor_read_rows();
+	return editor_goto_pending() || shown || !E.doc->loading;
+}
+
+/*
+ * Size the row array for the whole mapped file in one allocation.  The
+ * line count is extrapolated from the newlines in the first
+ * KILO_LOAD_SAMPLE bytes, which keeps the estimate O(1) in the size of
+ * the file; if it falls short, editor_new_row() grows the array as
+ * usual.
+ */
+void editor_estimate_rows()
+{
+	size_t sample = E.doc->mapsize < KILO_LOAD_SAMPLE ? E.doc->mapsize :
+		KILO_LOAD_SAMPLE;
+	char *p = E.doc->map;
+	char *end = E.doc->map + sample;
+	double lines = 1;
+	char *nl;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		lines++;
+		p = nl + 1;
+	}
+
+	double estimate = lines * ((double)E.doc->mapsize / sample);
+	if (estimate < INT_MAX) {
+		editor_reserve_rows(estimate);
+	}
+}
+
+/*
+ * Map the file read-only, so that rows can point into it.  Returns -1
+ * if the file cannot be mapped, in which case the caller falls back to
+ * reading it in chunks with read().
+ */
+int editor_map_file(int fd, size_t size)
+{
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	E.doc->map = map;
+	E.doc->mapsize = size;
+	editor_estimate_rows();
+	editor_start_loader(map, map + size);
+	editor_watch(E.doc->loader->notifyfd[0], editor_loader_event);
+	return 0;
+}
+
+/*
+ * Follow mode.
+ */
+#ifdef __linux__
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+#endif
+
+/*
+ * Read whatever was appended to the followed file since followoff.
+ * The incomplete line shown last is taken down first, and shown again
+ * with what was read after it.  If the cursor was on the last row it
+ * stays there, so that the view scrolls along with the file.  Returns
+ * non-zero if rows were added.
+ */
+int editor_follow_read()
+{
+	int atend = E.cy >= E.doc->numrows - 1;
+	int before = E.doc->numrows;
+	size_t got = 0;
+
+	if (E.doc->followpartial) {
+		editor_del_row(E.doc->numrows - 1);
+		E.doc->followpartial = 0;
+	}
+	while (1) {
+		editor_grow_loadbuf(KILO_READ_SIZE / 2);
+		size_t want = E.doc->loadcap - E.doc->loadlen;
+		ssize_t nread = pread(E.doc->followfd,
+				&E.doc->loadbuf[E.doc->loadlen], want,
+				E.doc->followoff);
+		E.stats.syscalls++;
+		if (nread == -1 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			break;
+		}
+		E.doc->followoff += nread;
+		got += nread;
+		editor_split_rows(nread);
+		if ((size_t)nread < want) {
+			break;
+		}
+	}
+	if (E.doc->loadlen > 0) {
+		editor_append_partial_row();
+		E.doc->followpartial = 1;
+	}
+
+	if (atend && E.doc->numrows > 0) {
+		E.cy = E.doc->numrows - 1;
+		E.cx = 0;
+	}
+	return got > 0 || E.doc->numrows != before;
+}
+
+#ifdef __linux__
+/*
+ * The followed path names a different file than followfd: switch to
+ * it and read it from the start.  Returns non-zero if it did.
+ */
+int editor_follow_reopen()
+{
+	int fd = open(E.doc->followpath, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+
+	struct stat st;
+	struct stat cur;
+	if (fstat(fd, &st) == -1 || (fstat(E.doc->followfd, &cur) == 0 &&
+				st.st_dev == cur.st_dev &&
+				st.st_ino == cur.st_ino)) {
+		close(fd);
+		return 0;
+	}
+
+	close(E.doc->followfd);
+	E.doc->followfd = fd;
+	E.doc->followoff = 0;
+	E.doc->followpartial = 0;
+	E.doc->loadlen = 0;
+	if (E.doc->filewd != -1) {
+		inotify_rm_watch(E.doc->inotifyfd, E.doc->filewd);
+	}
+	E.doc->filewd = inotify_add_watch(E.doc->inotifyfd, E.doc->followpath,
+			FOLLOW_FILE_EVENTS);
+	editor_set_status_message("%s was replaced, reading it from the start",
+			E.doc->followpath);
+	editor_follow_read();
+	return 1;
+}
+
+/*
+ * The file was written to, truncated, moved away or deleted, or a file
+ * appeared in its directory.  What is left in the old file is read
+ * before a rotated log is reopened.  A file cut shorter than the part
+ * already read is shown again from its start, dropping the old rows:
+ * the ones still pointing into the mapping would fault past the new
+ * end of the file.
+ */
+int editor_follow_event()
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	char *base = strrchr(E.doc->followpath, '/');
+	base = base ? base + 1 : E.doc->followpath;
+	int moved = 0;
+
+	ssize_t n;
+	while ((n = read(E.doc->inotifyfd, u.buf, sizeof(u.buf))) > 0) {
+		E.stats.syscalls++;
+		char *p = u.buf;
+		while (p < u.buf + n) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->wd == E.doc->filewd &&
+					(ev->mask & (IN_MOVE_SELF |
+						     IN_DELETE_SELF))) {
+				moved = 1;
+			}
+			if (ev->wd == E.doc->filewd &&
+					(ev->mask & IN_IGNORED)) {
+				E.doc->filewd = -1;
+			}
+			if (ev->wd == E.doc->dirwd && ev->len &&
+					strcmp(ev->name, base) == 0) {
+				moved = 1;
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	E.stats.syscalls++;
+
+	int changed = editor_follow_read();
+
+	struct stat st;
+	if (fstat(E.doc->followfd, &st) == 0 && st.st_size < E.doc->followoff) {
+		editor_free_rows();
+		E.cx = 0;
+		E.cy = 0;
+		E.rowoff = 0;
+		E.coloff = 0;
+		E.gotowait = 0;
+		E.doc->followoff = 0;
+		E.doc->followpartial = 0;
+		E.doc->loadlen = 0;
+		editor_set_status_message("%s was truncated",
+			E.doc->followpath);
+		editor_follow_read();
+		changed = 1;
+	}
+	if (moved && editor_follow_reopen()) {
+		changed = 1;
+	}
+	return changed;
+}
+#endif
+
+/*
+ * Start following the opened file through fd, which has been read up
+ * to off.  Returns -1 if it cannot be followed.
+ */
+int editor_follow_fd(int fd, off_t off)
+{
+#ifdef __linux__
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+	E.doc->inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (E.doc->inotifyfd == -1) {
+		return -1;
+	}
+	E.doc->filewd = inotify_add_watch(E.doc->inotifyfd, E.doc->followpath,
+			FOLLOW_FILE_EVENTS);
+
+	char *slash = strrchr(E.doc->followpath, '/');
+	if (slash == NULL) {
+		E.doc->dirwd = inotify_add_watch(E.doc->inotifyfd, ".",
+				FOLLOW_DIR_EVENTS);
+	} else {
+		char *dir = strndup(E.doc->followpath,
+				slash == E.doc->followpath ? 1 :
+				(size_t)(slash - E.doc->followpath));
+		if (dir) {
+			E.doc->dirwd = inotify_add_watch(E.doc->inotifyfd, dir,
+					FOLLOW_DIR_EVENTS);
+			free(dir);
+		}
+	}
+
+	E.doc->followfd = fd;
+	E.doc->followoff = off;
+	E.doc->followpartial = E.doc->loadlen > 0;
+	editor_watch(E.doc->inotifyfd, editor_follow_event);
+	editor_follow_read();
+	return 0;
+#else
+	(void)fd;
+	(void)off;
+	editor_set_status_message("Follow mode needs inotify");
+	return -1;
+#endif
+}
+
+/*
+ * The loader is done with a mapped file that is followed.  A last line
+ * without a newline is copied to loadbuf, so that it is completed by
+ * the bytes appended after it.
+ */
+void editor_follow_map()
+{
+	int fd = E.doc->followfd;
+	E.doc->followfd = -1;
+
+	if (E.doc->numrows > 0 && E.doc->map[E.doc->mapsize - 1] != '\n') {
+		erow *last = editor_row_at(E.doc->numrows - 1);
+		size_t len = &E.doc->map[E.doc->mapsize] - last->chars;
+		editor_grow_loadbuf(len);
+		memcpy(E.doc->loadbuf, last->chars, len);
+		E.doc->loadlen = len;
+	}
+	if (editor_follow_fd(fd, E.doc->mapsize) == -1) {
+		close(fd);
+		E.doc->loadlen = 0;
+	}
+}
+
+/*
+ * Load the file open on fd, whose fstat() is st, into the current
+ * document.
+ */
+void editor_load(int fd, struct stat *st, char *filename)
+{
+	/*
+	 * Regular files are mapped rather than copied, so that opening
+	 * a large file costs neither a read of the whole file into the
+	 * heap nor a second copy of every line.  Anything else (empty
+	 * files, pipes, character devices) is read in chunks.
+	 */
+	if (S_ISREG(st->st_mode) && st->st_size > 0 &&
+			(off_t)(size_t)st->st_size == st->st_size &&
+			editor_map_file(fd, st->st_size) == 0) {
+		if (E.follow) {
+			E.doc->followpath = strdup(filename);
+			E.doc->followfd = fd;
+		} else {
+			close(fd);
+		}
+
+		struct pollfd pfd = { E.doc->loader->notifyfd[0], POLLIN, 0 };
+		while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+			;
+		}
+		editor_collect_rows();
+	} else {
+		if (E.follow) {
+			E.doc->followpath = strdup(filename);
+		}
+		E.doc->loadfd = fd;
+		E.doc->loading = 1;
+		editor_watch(fd, editor_read_event);
+	}
+}
+
+/*
+ * Page through standard input, which is read like a pipe.
+ */
+void editor_open_pager()
+{
+	E.doc->pager = 1;
+	E.doc->loadfd = STDIN_FILENO;
+	E.doc->loading = 1;
+	editor_watch(E.doc->loadfd, editor_read_event);
+}
+
+/*
+ * Release all rows: the row blocks, the arena with all row text, and
+ * the mapping.  The loader must have been stopped.
+ */
+void editor_free_rows()
+{
+	arena_free(&E.doc->arena);
+	for (int i = 0; i < E.doc->nblocks; i++) {
+		free(E.doc->blocks[i]);
+	}
+	free(E.doc->blocks);
+	free(E.doc->blockstart);
+	E.doc->blocks = NULL;
+	E.doc->blockstart = NULL;
+	E.doc->numrows = 0;
+	E.doc->nblocks = 0;
+	E.doc->blockcap = 0;
+	E.doc->hlexact = 0;
+	E.doc->hlguessend = 0;
+	free(E.doc->renders);
+	E.doc->renders = NULL;
+	E.doc->nrenders = 0;
+	E.doc->rendercap = 0;
+	E.rxc.chars = NULL;
+	E.doc->nlf = 0;
+	E.doc->ncrlf = 0;
+
+	if (E.doc->map) {
+		munmap(E.doc->map, E.doc->mapsize);
+		E.doc->map = NULL;
+		E.doc->mapsize = 0;
+		E.doc->nmapped = 0;
+		E.doc->nowned = 0;
+	}
+}
+
+/*
+ * Release everything the opened file holds: the loader, the rows and
+ * the descriptors it is read or followed through.
+ */
+void editor_close()
+{
+	if (E.doc->loader) {
+		loader_stop(E.doc->loader);
+		E.doc->loader = NULL;
+	}
+	editor_free_rows();
+
+	if (E.doc->loadfd != -1) {
+		editor_unwatch(E.doc->loadfd);
+		close(E.doc->loadfd);
+		E.doc->loadfd = -1;
+	}
+	free(E.doc->loadbuf);
+	E.doc->loadbuf = NULL;
+	E.doc->loadlen = 0;
+	E.doc->loadcap = 0;
+	E.doc->loading = 0;
+
+	if (E.doc->inotifyfd != -1) {
+		editor_unwatch(E.doc->inotifyfd);
+		close(E.doc->inotifyfd);
+		E.doc->inotifyfd = -1;
+		E.doc->filewd = -1;
+		E.doc->dirwd = -1;
+	}
+	if (E.doc->followfd != -1) {
+		close(E.doc->followfd);
+		E.doc->followfd = -1;
+	}
+	free(E.doc->followpath);
+	E.doc->followpath = NULL;
+	E.doc->followoff = 0;
+	E.doc->followpartial = 0;
+
+	free(E.doc->path);
+	E.doc->path = NULL;
+	E.doc->syntax = NULL;
+	E.doc->dev = 0;
+	E.doc->ino = 0;
+	E.doc->pager = 0;
+	E.doc->rowbase = 0;
+}
+
+/*
+ * Buffers.
+ *
+ * Only the current document is watched by the event loop.  Switching
+ * away from a document that is still loading or being followed stops
+ * watching its descriptors, so its loader merely stalls once its ring
+ * is full; switching back watches them again and catches up with
+ * whatever arrived meanwhile.  Its rows stay resident throughout.
+ */
+struct document *editor_new_document()
+{
+	struct document *d = malloc(sizeof(*d));
+	if (d == NULL) {
+		die("malloc");
+	}
+	d->path = NULL;
+	d->dev = 0;
+	d->ino = 0;
+	d->refs = 0;
+	d->syntax = NULL;
+	d->hlexact = 0;
+	d->hlguessend = 0;
+	d->numrows = 0;
+	d->blocks = NULL;
+	d->blockstart = NULL;
+	d->nblocks = 0;
+	d->blockcap = 0;
+	d->map = NULL;
+	d->mapsize = 0;
+	d->nmapped = 0;
+	d->nowned = 0;
+	d->renders = NULL;
+	d->nrenders = 0;
+	d->rendercap = 0;
+	d->arena.head = NULL;
+	d->arena.total = 0;
+	d->loading = 0;
+	d->loader = NULL;
+	d->loadfd = -1;
+	d->loadbuf = NULL;
+	d->loadlen = 0;
+	d->loadcap = 0;
+	d->nlf = 0;
+	d->ncrlf = 0;
+	d->pager = 0;
+	d->rowbase = 0;
+	d->followpath = NULL;
+	d->followfd = -1;
+	d->followoff = 0;
+	d->followpartial = 0;
+	d->inotifyfd = -1;
+	d->filewd = -1;
+	d->dirwd = -1;
+	return d;
+}
+
+void editor_detach_document()
+{
+	if (E.doc->loader) {
+		editor_unwatch(E.doc->loader->notifyfd[0]);
+	}
+	if (E.doc->loadfd != -1) {
+		editor_unwatch(E.doc->loadfd);
+	}
+	if (E.doc->inotifyfd != -1) {
+		editor_unwatch(E.doc->inotifyfd);
+	}
+}
+
+void editor_attach_document()
+{
+	if (E.doc->loader) {
+		editor_watch(E.doc->loader->notifyfd[0], editor_loader_event);
+		editor_collect_rows();
+	}
+	if (E.doc->loadfd != -1) {
+		editor_watch(E.doc->loadfd, editor_read_event);
+	}
+#ifdef __linux__
+	if (E.doc->inotifyfd != -1) {
+		editor_watch(E.doc->inotifyfd, editor_follow_event);
+		editor_follow_event();
+	}
+#endif
+}
+
+/*
+ * Drop a reference to d, and release it with the last one.
+ */
+void editor_release_document(struct document *d)
+{
+	if (--d->refs > 0) {
+		return;
+	}
+	struct document *cur = E.doc;
+	E.doc = d;
+	editor_close();
+	E.doc = cur == d ? NULL : cur;
+	free(d);
+}
+
+/*
+ * Make buffer i current, saving the view of the current one.  The view
+ * restored is clamped to the document, which may have been truncated
+ * while another buffer showed it.
+ */
+void editor_switch_buffer(int i)
+{
+	struct buffer *b = E.buffers[E.curbuf];
+	b->cx = E.cx;
+	b->cy = E.cy;
+	b->rowoff = E.rowoff;
+	b->coloff = E.coloff;
+	b->gotowait = E.gotowait;
+	b->gotorow = E.gotorow;
+	b->gotooff = E.gotooff;
+
+	b = E.buffers[i];
+	E.curbuf = i;
+	E.cx = b->cx;
+	E.cy = b->cy;
+	E.rowoff = b->rowoff;
+	E.coloff = b->coloff;
+	E.gotowait = b->gotowait;
+	E.gotorow = b->gotorow;
+	E.gotooff = b->gotooff;
+	E.rxc.chars = NULL;
+
+	/*
+	 * The shadow holds the other buffer's rows, so there is nothing
+	 * to gain from scrolling it.
+	 */
+	E.shadowrowoff = E.rowoff;
+
+	if (b->doc != E.doc) {
+		editor_detach_document();
+		E.doc = b->doc;
+		editor_attach_document();
+	}
+	if (E.cy > E.doc->numrows) {
+		E.cy = E.doc->numrows;
+	}
+	editor_clamp_cx();
+}
+
+/*
+ * Add a buffer on d after the current one and switch to it.
+ */
+void editor_add_buffer(struct document *d)
+{
+	struct buffer *b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		die("calloc");
+	}
+	b->doc = d;
+	d->refs++;
+
+	E.buffers = realloc(E.buffers,
+		sizeof(struct buffer *) * (E.nbuffers + 1));
+	if (E.buffers == NULL) {
+		die("realloc");
+	}
+	int at = E.nbuffers ? E.curbuf + 1 : 0;
+	memmove(&E.buffers[at + 1], &E.buffers[at],
+		sizeof(struct buffer *) * (E.nbuffers - at));
+	E.buffers[at] = b;
+	E.nbuffers++;
+	if (E.nbuffers == 1) {
+		E.curbuf = 0;
+		E.doc = d;
+		editor_attach_document();
+	} else {
+		editor_switch_buffer(at);
+	}
+}
+
+/*
+ * Whether the current buffer is the empty one kilo starts with, which
+ * the first file opened replaces rather than joins.
+ */
+int editor_scratch_buffer()
+{
+	return E.doc->refs == 1 && E.doc->path == NULL && !E.doc->pager &&
+		E.doc->numrows == 0 && !E.doc->loading;
+}
+
+/*
+ * Open filename in a new buffer.  If a buffer already shows the same
+ * file, the new one shares its document: no second mapping, no second
+ * load.  Returns -1, with errno set, if the file cannot be opened or
+ * is a directory.
+ */
+int editor_open(char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		close(fd);
+		errno = EISDIR;
+		return -1;
+	}
+
+	for (int i = 0; i < E.nbuffers; i++) {
+		struct document *d = E.buffers[i]->doc;
+		if (d->path && d->dev == st.st_dev && d->ino == st.st_ino) {
+			close(fd);
+			editor_add_buffer(d);
+			return 0;
+		}
+	}
+
+	if (!editor_scratch_buffer()) {
+		editor_add_buffer(editor_new_document());
+	}
+	E.doc->path = strdup(filename);
+	E.doc->dev = st.st_dev;
+	E.doc->ino = st.st_ino;
+	E.doc->syntax = editor_select_syntax(filename);
+	editor_load(fd, &st, filename);
+	return 0;
+}
+
+/*
+ * Tell which buffer is current, in the message bar.
+ */
+void editor_show_buffer()
+{
+	char *name = E.doc->path;
+	if (name == NULL) {
+		name = E.doc->pager ? "(standard input)" : "(no file)";
+	}
+	char *eol = editor_eol_name();
+	if (eol) {
+		editor_set_status_message("[%d/%d] %s: %s line endings",
+			E.curbuf + 1, E.nbuffers, name, eol);
+	} else {
+		editor_set_status_message("[%d/%d] %s", E.curbuf + 1,
+			E.nbuffers, name);
+	}
+}
+
+/*
+ * Close the current buffer, unless it is the last one.
+ */
+void editor_close_buffer()
+{
+	if (E.nbuffers == 1) {
+		editor_set_status_message("This is the last buffer");
+		return;
+	}
+
+	int at = E.curbuf;
+	struct buffer *b = E.buffers[at];
+	editor_switch_buffer(at > 0 ? at - 1 : at + 1);
+	memmove(&E.buffers[at], &E.buffers[at + 1],
+		sizeof(struct buffer *) * (E.nbuffers - at - 1));
+	E.nbuffers--;
+	if (E.curbuf > at) {
+		E.curbuf--;
+	}
+	editor_release_document(b->doc);
+	free(b);
+	editor_show_buffer();
+}
+
+void editor_cycle_buffer(int delta)
+{
+	if (E.nbuffers > 1) {
+		editor_switch_buffer((E.curbuf + delta + E.nbuffers) %
+			E.nbuffers);
+	}
+	editor_show_buffer();
+}
+
+/*
+ * Release every buffer, before exiting.
+ */
+void editor_close_all()
+{
+	while (E.nbuffers > 0) {
+		struct buffer *b = E.buffers[--E.nbuffers];
+		editor_release_document(b->doc);
+		free(b);
+	}
+	E.curbuf = 0;
+}
+
+/*
+ * Append buffer.
+ */
+void ab_reserve(struct abuf *ab, int cap)
+{
+	if (cap <= ab->cap) {
+		return;
+	}
+
+	char *new = realloc(ab->b, cap);
+	if (new == NULL) {
+		return;
+	}
+	ab->b = new;
+	ab->cap = cap;
+}
+
+void ab_append(struct abuf *ab, const char *s, int len)
+{
+	if (len <= 0) {
+		return;
+	}
+	if (ab->len + len > ab->cap) {
+		int cap = ab->cap ? ab->cap * 2 : 64;
+		while (cap < ab->len + len) {
+			cap *= 2;
+		}
+		ab_reserve(ab, cap);
+		if (ab->len + len > ab->cap) {
+			return;
+		}
+	}
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+void ab_free(struct abuf *ab)
+{
+	free(ab->b);
+	ab->b = NULL;
+	ab->len = 0;
+	ab->cap = 0;
+}
+
+void editor_scroll()
+{
+	E.rx = 0;
+	if (E.cy < E.doc->numrows) {
+		E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
+	}
+
+	if (E.cy < E.rowoff) {
+		E.rowoff = E.cy;
+	}
+	if (E.cy >= E.rowoff + E.screenrows) {
+		E.rowoff = E.cy - E.screenrows + 1;
+	}
+
+	if (E.rx < E.coloff) {
+		E.coloff = E.rx;
+	}
+	if (E.rx >= E.coloff + E.screencols) {
+		E.coloff = E.rx - E.screencols + 1;
+	}
+}
+
+/*
+ * Length of the run of ASCII other than tabs at the start of p, of at
+ * most n bytes.  Each of these bytes takes one column, so callers
+ * bound n by the columns they still need rather than by the row.
+ */
+size_t editor_plain_span(char *p, size_t n)
+{
+	n = utf8_ascii_span(p, n);
+	char *tab = memchr(p, '\t', n);
+	return tab ? (size_t)(tab - p) : n;
+}
+
+/*
+ * Switch the foreground to the color of the class hl, unless *color
+ * already is that color.
+ */
+void editor_draw_color(struct abuf *ab, int *color, int hl)
+{
+	int c = editor_syntax_to_color(hl);
+	if (c != *color) {
+		char buf[16];
+		int len = snprintf(buf, sizeof(buf), "\x1b[%dm", c);
+		ab_append(ab, buf, len);
+		*color = c;
+	}
+}
+
+/*
+ * Draw the columns [E.coloff, E.coloff + E.screencols) of a row
+ * straight from chars, expanding tabs and measuring UTF-8 on the way.
+ * A long row starts from its last mark before E.coloff, so this costs
+ * at most KILO_RX_MARK_STEP bytes plus the width of the screen.  A
+ * tab or wide character cut by either edge of the screen is drawn as
+ * spaces, and invalid bytes as '?'.  If hl is given, the text is
+ * colored by it.
+ */
+void editor_draw_window(struct abuf *ab, erow *row, struct erender r,
+		unsigned char *hl)
+{
+	int color = 39;
+	char *p = row->chars;
+	char *end = &row->chars[row->size];
+	int col = 0;
+	int w;
+	int len;
+	int valid;
+
+	if (r.marks) {
+		int lo = 0;
+		int hi = r.nmarks;
+		while (hi - lo > 1) {
+			int mid = lo + (hi - lo) / 2;
+			if (r.marks[mid] <= E.coloff) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		p += lo * KILO_RX_MARK_STEP;
+		col = r.marks[lo];
+	}
+
+	while (p < end && col < E.coloff) {
+		if (*p == '\t') {
+			w = KILO_TAB_STOP - col % KILO_TAB_STOP;
+			len = 1;
+		} else if (!(*p & 0x80)) {
+			size_t n = end - p;
+			if (n > (size_t)(E.coloff - col)) {
+				n = E.coloff - col;
+			}
+			n = editor_plain_span(p, n);
+			p += n;
+			col += n;
+			continue;
+		} else {
+			len = utf8_char(p, end, &w, &valid);
+		}
+		p += len;
+		col += w;
+	}
+
+	int x = col - E.coloff;
+	if (x > E.screencols) {
+		x = E.screencols;
+	}
+	for (int i = 0; i < x; i++) {
+		ab_append(ab, " ", 1);
+	}
+
+	while (p < end && x < E.screencols) {
+		if (*p == '\t') {
+			w = KILO_TAB_STOP - (E.coloff + x) % KILO_TAB_STOP;
+			if (w > E.screencols - x) {
+				w = E.screencols - x;
+			}
+			for (int i = 0; i < w; i++) {
+				ab_append(ab, " ", 1);
+			}
+			p++;
+			x += w;
+			continue;
+		}
+		if (!(*p & 0x80)) {
+			size_t n = end - p;
+			if (n > (size_t)(E.screencols - x)) {
+				n = E.screencols - x;
+			}
+			n = editor_plain_span(p, n);
+			if (hl) {
+				unsigned char *h = &hl[p - row->chars];
+				size_t m = 1;
+				while (m < n && h[m] == h[0]) {
+					m++;
+				}
+				n = m;
+				editor_draw_color(ab, &color, h[0]);
+			}
+			ab_append(ab, p, n);
+			p += n;
+			x += n;
+			continue;
+		}
+
+		len = utf8_char(p, end, &w, &valid);
+		if (x + w > E.screencols) {
+			ab_append(ab, " ", E.screencols - x);
+			break;
+		}
+		if (hl) {
+			editor_draw_color(ab, &color, hl[p - row->chars]);
+		}
+		if (valid) {
+			ab_append(ab, p, len);
+		} else if (w) {
+			ab_append(ab, "?", 1);
+		}
+		p += len;
+		x += w;
+	}
+	editor_draw_color(ab, &color, HL_NORMAL);
+}
+
+/*
+ * Append what screen row i should show to ab, without any escape
+ * sequences.  The row below the text is the message bar.
+ */
+void editor_draw_row(struct abuf *ab, int i)
+{
+	if (i == E.screenrows) {
+		int msglen = strlen(E.statusmsg);
+		if (msglen > E.screencols) {
+			msglen = E.screencols;
+		}
+		if (msglen &&
+				time(NULL) - E.statusmsg_time < KILO_MSG_TIMEOUT) {
+			ab_append(ab, E.statusmsg, msglen);
+		} else if (E.stats.on) {
+			char buf[128];
+			stats_line(buf, sizeof(buf));
+			int len = strlen(buf);
+			ab_append(ab, buf,
+				len > E.screencols ? E.screencols : len);
+		}
+		return;
+	}
+
+	int filerow = i + E.rowoff;
+	if (filerow >= E.doc->numrows) {
+		if (E.doc->numrows == 0 && !E.doc->loading &&
+				i == E.screenrows / 3) {
+			char welcome[80];
+			int welcomelen = snprintf(
+				welcome,
+				sizeof(welcome),
+				"Kilo editor -- version %s",
+				KILO_VERSION);
+			if (welcomelen > E.screencols) {
+				welcomelen = E.screencols;
+			}
+			int padding = (E.screencols - welcomelen) / 2;
+			if (padding) {
+				ab_append(ab, "~", 1);
+				padding--;
+			}
+			while (padding--) {
+				ab_append(ab, " ", 1);
+			}
+			ab_append(ab, welcome, welcomelen);
+		} else {
+			ab_append(ab, "~", 1);
+		}
+	} else {
+		erow *row = editor_row_at(filerow);
+		struct erender r = editor_row_render(row);
+		unsigned char *hl = editor_hl_draw(filerow);
+		if (r.marks || row->info & ROW_UTF8 || hl) {
+			editor_draw_window(ab, row, r, hl);
+			return;
+		}
+
+		int len = r.rsize - E.coloff;
+		/*
+		 * Note that when subtracting E.coloff from the length,
+		 * len can now be a negative number, meaning the user
+		 * scrolled horizontally past the end of the line.  In
+		 * that case, we set len to 0 so that nothing is
+		 * displayed on that line.
+		 */
+		if (len < 0) {
+			len = 0;
+		}
+		if (len > E.screencols) {
+			len = E.screencols;
+		}
+		ab_append(ab, &r.render[E.coloff], len);
+	}
+}
+
+void editor_shadow_reverse(int from, int to)
+{
+	while (from < --to) {
+		struct abuf tmp = E.shadow[from];
+		E.shadow[from] = E.shadow[to];
+		E.shadow[to] = tmp;
+		from++;
+	}
+}
+
+/*
+ * When the view moved by fewer rows than fit on the screen, let the
+ * terminal scroll what it already shows instead of repainting it.
+ * The S command (Scroll Up) and T command (Scroll Down) move the
+ * lines inside the scrolling region, which the r command (DECSTBM)
+ * sets to the text area so that nothing below it moves.  The shadow
+ * rows are rotated the same way, and the rows scrolled into view are
+ * blank, so the diff in editor_draw_rows() only draws those.
+ */
+void editor_scroll_shadow(struct abuf *ab)
+{
+	int n = E.rowoff - E.shadowrowoff;
+	int count = n < 0 ? -n : n;
+
+	E.shadowrowoff = E.rowoff;
+	if (!E.shadowvalid || n == 0 || count >= E.screenrows) {
+		return;
+	}
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+			E.screenrows, count, n > 0 ? 'S' : 'T');
+	ab_append(ab, buf, strlen(buf));
+
+	/*
+	 * Rotate the shadow by n rows, in place, with three reversals.
+	 */
+	int split = n > 0 ? count : E.screenrows - count;
+	editor_shadow_reverse(0, split);
+	editor_shadow_reverse(split, E.screenrows);
+	editor_shadow_reverse(0, E.screenrows);
+
+	int first = n > 0 ? E.screenrows - count : 0;
+	int i;
+	for (i = first; i < first + count; i++) {
+		E.shadow[i].len = 0;
+	}
+}
+
+/*
+ * Emit the screen rows that differ from what the terminal already
+ * shows.  Each changed row is reached with a cursor position escape,
+ * or with a plain CR LF when it directly follows the previous changed
+ * row.  If the old and new row start with the same printable ASCII,
+ * that prefix is skipped as well, since it maps one byte to one
+ * column.
+ */
+void editor_draw_rows(struct abuf *ab)
+{
+	struct abuf *line = &E.line;
+	int last = -2;
+	int i;
+
+	editor_scroll_shadow(ab);
+	for (i = 0; i <= E.screenrows; i++) {
+		struct abuf *old = &E.shadow[i];
+
+		line->len = 0;
+		editor_draw_row(line, i);
+
+		int same = 0;
+		if (E.shadowvalid) {
+			int n = line->len < old->len ? line->len : old->len;
+			while (same < n && line->b[same] == old->b[same] &&
+					line->b[same] >= ' ' &&
+					line->b[same] <= '~') {
+				same++;
+			}
+			if (line->len == old->len && same == line->len) {
+				continue;
+			}
+		}
+
+		char buf[32];
+		if (same == 0 && last == i - 1) {
+			ab_append(ab, "\r\n", 2);
+		} else {
+			snprintf(buf, sizeof(buf), "\x1b[%d;%dH", i + 1, same + 1);
+			ab_append(ab, buf, strlen(buf));
+		}
+		ab_append(ab, &line->b[same], line->len - same);
+		/*
+		 * The K command (Erase In Line) erases part of the
+		 * current line.  Its argument is analogous to the J
+		 * command's argument: 2 erases the whole line,
+		 * 1 erases the part of the line to the left of the
+		 * cursor, and 0 erases the part of the line to the
+		 * right of the cursor.  0 is the default argument,
+		 * and that's what we want, so we leave out the
+		 * argument and just use <esc>[K.
+		 */
+		ab_append(ab, "\x1b[K", 3);
+		last = i;
+
+		old->len = 0;
+		ab_append(old, line->b, line->len);
+	}
+	E.shadowvalid = 1;
+}
+
+void editor_refresh_screen()
+{
+	struct timespec t;
+	stats_start(&t);
+	editor_scroll();
+
+	struct abuf *ab = &E.frame;
+	ab->len = 0;
+
+	/*
+	 * The l and h commands in the escape sequences below are used
+	 * to tell the terminal to hide and show the cursor.  Note that
+	 * some terminals might not support hiding/showing the cursor,
+	 * because the argument "?25" appeared in later VT models, not
+	 * VT100.
+	 */
+	ab_append(ab, "\x1b[?25l", 6);
+	struct timespec dt;
+	stats_start(&dt);
+	editor_draw_rows(ab);
+	stats_stop(&E.stats.draw, &dt);
+
+	/*
+	 * If no row changed there is no need to hide the cursor, and
+	 * if it did not move either, nothing is written at all.
+	 */
+	int drawn = ab->len > 6;
+	if (!drawn) {
+		ab->len = 0;
+	}
+
+	int cy = E.cy - E.rowoff + 1;
+	int cx = E.rx - E.coloff + 1;
+	if (drawn || cy != E.shadowcy || cx != E.shadowcx) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+		ab_append(ab, buf, strlen(buf));
+	}
+	if (drawn) {
+		ab_append(ab, "\x1b[?25h", 6);
+	}
+	E.shadowcy = cy;
+	E.shadowcx = cx;
+
+	if (ab->len > 0) {
+		write(E.outfd, ab->b, ab->len);
+		E.stats.syscalls++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &E.lastframe);
+
+	struct editor_stats *st = &E.stats;
+	st->frames++;
+	st->written += ab->len;
+	st->lastwritten = ab->len;
+	if (st->keys != st->keysmark) {
+		st->keysyscalls = (double)(st->syscalls - st->keymark) /
+			(st->keys - st->keysmark);
+		st->keysmark = st->keys;
+		st->keymark = st->syscalls;
+	}
+	if (st->on) {
+		st->rowmem = stats_row_memory();
+		if (st->rowmem > st->peakrowmem) {
+			st->peakrowmem = st->rowmem;
+		}
+	}
+	stats_stop(&st->refresh, &t);
+}
+
+/*
+ * Fit the editor to the current terminal size.  The shadow frame is
+ * resized and invalidated, so the next refresh repaints everything
+ * once for the new layout.
+ */
+void editor_resize()
+{
+	int rows;
+	int cols;
+	if (get_window_size(&rows, &cols) == -1) {
+		die("get_window_size");
+	}
+
+	/*
+	 * The bottom row of the terminal is the message bar, which has
+	 * a shadow row of its own.
+	 */
+	if (rows < 2) {
+		rows = 2;
+	}
+	int old = E.shadow ? E.screenrows + 1 : 0;
+	int i;
+	for (i = rows; i < old; i++) {
+		ab_free(&E.shadow[i]);
+	}
+	E.shadow = realloc(E.shadow, sizeof(struct abuf) * rows);
+	if (E.shadow == NULL) {
+		die("realloc");
+	}
+	for (i = old; i < rows; i++) {
+		E.shadow[i] = (struct abuf)ABUF_INIT;
+	}
+	E.shadowvalid = 0;
+
+	E.screenrows = rows - 1;
+	E.screencols = cols;
+	ab_reserve(&E.frame, rows * (E.screencols + 16));
+	ab_reserve(&E.line, E.screencols);
+}
+
+void editor_sigwinch(int sig)
+{
+	int saved = errno;
+	(void)sig;
+	write(E.winchfd[1], "", 1);
+	errno = saved;
+}
+
+/*
+ * However many resizes arrived since the last poll(), they are handled
+ * with a single relayout.
+ */
+int editor_winch_event()
+{
+	char buf[64];
+	while (read(E.winchfd[0], buf, sizeof(buf)) > 0) {
+		E.stats.syscalls++;
+	}
+	E.stats.syscalls++;
+	editor_resize();
+	return 1;
+}
+
+/*
+ * Wait until something happens that changes the screen: keys were
+ * pressed, the terminal was resized, rows were loaded into view, or
+ * guessed highlighting was put right.  Returns 1 if there are keys to
+ * read.
+ */
+int editor_wait_events()
+{
+	struct pollfd pfd[KILO_MAX_WATCHES + 1];
+
+	while (E.inpos == E.inlen) {
+		int n = 0;
+		int i;
+
+		pfd[n].fd = E.ttyfd;
+		pfd[n].events = POLLIN;
+		n++;
+		for (i = 0; i < E.nwatches; i++) {
+			pfd[n].fd = E.watches[i].fd;
+			pfd[n].events = POLLIN;
+			n++;
+		}
+
+		/*
+		 * With highlighting left to put right, poll() only
+		 * checks for events, and the work is done in between.
+		 */
+		int idle = editor_hl_pending();
+		E.stats.syscalls++;
+		int ready = poll(pfd, n, idle ? 0 : -1);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			die("poll");
+		}
+		if (ready == 0) {
+			if (editor_hl_idle()) {
+				return 0;
+			}
+			continue;
+		}
+
+		/*
+		 * A handler may unwatch descriptors, so each one is
+		 * looked up again rather than indexed.
+		 */
+		int refresh = 0;
+		for (i = 1; i < n; i++) {
+			int j;
+			if (!pfd[i].revents) {
+				continue;
+			}
+			for (j = 0; j < E.nwatches; j++) {
+				if (E.watches[j].fd == pfd[i].fd) {
+					refresh |= E.watches[j].handler();
+					break;
+				}
+			}
+		}
+		if (pfd[0].revents) {
+			return 1;
+		}
+		if (refresh) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void editor_set_status_message(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+}
+
+/*
+ * Ask for a line of input in the message bar.  prompt is a format
+ * string that receives the input typed so far.  If callback is given,
+ * it is called with the input and the key after every keypress.
+ * Returns the input, which the caller must free, or NULL if the user
+ * pressed Escape.  The event loop keeps running meanwhile, so loading
+ * and resizes carry on behind the prompt.
+ */
+char *editor_prompt(char *prompt, void (*callback)(char *, int))
+{
+	size_t bufsize = 128;
+	char *buf = malloc(bufsize);
+	size_t buflen = 0;
+	buf[0] = '\0';
+
+	while (1) {
+		editor_set_status_message(prompt, buf);
+		editor_refresh_screen();
+		if (!editor_wait_events()) {
+			continue;
+		}
+
+		int c = editor_read_key();
+		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+			if (buflen != 0) {
+				buf[--buflen] = '\0';
+			}
+		} else if (c == '\x1b') {
+			editor_set_status_message("");
+			if (callback) {
+				callback(buf, c);
+			}
+			free(buf);
+			return NULL;
+		} else if (c == '\r') {
+			if (buflen != 0) {
+				editor_set_status_message("");
+				if (callback) {
+					callback(buf, c);
+				}
+				return buf;
+			}
+		} else if (c < 128 && !iscntrl(c)) {
+			if (buflen == bufsize - 1) {
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			buf[buflen++] = c;
+			buf[buflen] = '\0';
+		}
+
+		if (callback) {
+			callback(buf, c);
+		}
+	}
+}
+
+/*
+ * Goto line.
+ *
+ * Any row already loaded is reached directly through its index.  A
+ * percentage of a mapped file is turned into a byte offset, and since
+ * mapped rows point into the mapping in file order, the row array
+ * itself is a line-offset index that can be binary searched.  Targets
+ * that have not been loaded yet are remembered in E.gotowait, and
+ * taken as soon as the loader gets there.
+ */
+enum editor_goto {
+	GOTO_NONE,
+	GOTO_ROW,
+	GOTO_OFFSET
+};
+
+/*
+ * Offset of a row in the mapping.  A row that got its own copy of
+ * its text no longer points into the mapping, so the next mapped row
+ * stands in for it.
+ */
+size_t editor_row_offset(int at)
+{
+	while (at < E.doc->numrows && !(editor_row_at(at)->info & ROW_MAPPED)) {
+		at++;
+	}
+	return at < E.doc->numrows ?
+		(size_t)(editor_row_at(at)->chars - E.doc->map) :
+		E.doc->mapsize;
+}
+
+/*
+ * Index of the last row that starts at or before off in the mapping.
+ */
+int editor_offset_to_row(size_t off)
+{
+	int lo = 0;
+	int hi = E.doc->numrows;
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (editor_row_offset(mid) <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void editor_goto_row(int at)
+{
+	if (at >= E.doc->numrows && E.doc->loading) {
+		E.gotowait = GOTO_ROW;
+		E.gotorow = at;
+		editor_set_status_message("Loading up to line %d...", at + 1);
+		return;
+	}
+	if (at >= E.doc->numrows) {
+		at = E.doc->numrows > 0 ? E.doc->numrows - 1 : 0;
+	}
+
+	E.gotowait = GOTO_NONE;
+	E.cy = at;
+	E.cx = 0;
+	E.rowoff = at - E.screenrows / 2;
+	if (E.rowoff < 0) {
+		E.rowoff = 0;
+	}
+}
+
+void editor_goto_offset(size_t off)
+{
+	if (E.doc->loading && (E.doc->numrows == 0 ||
+				editor_row_offset(E.doc->numrows - 1) < off)) {
+		E.gotowait = GOTO_OFFSET;
+		E.gotooff = off;
+		editor_set_status_message("Loading...");
+		return;
+	}
+
+	editor_goto_row(editor_offset_to_row(off));
+}
+
+/*
+ * Take a goto target that was waiting for rows to be loaded, if they
+ * are now.  Returns 1 if the view moved.
+ */
+int editor_goto_pending()
+{
+	if (E.gotowait == GOTO_ROW &&
+			(E.gotorow < E.doc->numrows || !E.doc->loading)) {
+		editor_goto_row(E.gotorow);
+	} else if (E.gotowait == GOTO_OFFSET && (!E.doc->loading ||
+				editor_row_offset(E.doc->numrows - 1) >=
+				E.gotooff)) {
+		editor_goto_offset(E.gotooff);
+	} else {
+		return 0;
+	}
+	editor_set_status_message("");
+	return 1;
+}
+
+void editor_goto_line()
+{
+	char *query = editor_prompt("Go to line or percentage: %s", NULL);
+	if (query == NULL) {
+		return;
+	}
+
+	char *end;
+	long n = strtol(query, &end, 10);
+	if (*end == '%' && end[1] == '\0' && n >= 0 && n <= 100) {
+		if (E.doc->map) {
+			editor_goto_offset(E.doc->mapsize / 100 * n +
+					E.doc->mapsize % 100 * n / 100);
+		} else {
+			editor_goto_row(E.doc->numrows / 100 * n +
+					E.doc->numrows % 100 * n / 100);
+		}
+	} else if (*end == '\0' && n >= 1 && n <= INT_MAX) {
+		editor_goto_row(n - 1 > E.doc->rowbase ?
+				n - 1 - E.doc->rowbase : 0);
+	} else {
+		editor_set_status_message("Not a line number: %s", query);
+	}
+	free(query);
+}
+
+/*
+ * Ask for a file name and open it in a new buffer.
+ */
+void editor_open_prompt()
+{
+	char *name = editor_prompt("Open: %s", NULL);
+	if (name == NULL) {
+		return;
+	}
+	if (name[0] && editor_open(name) == -1) {
+		editor_set_status_message("Can't open %s: %s", name,
+			strerror(errno));
+	} else if (name[0]) {
+		editor_show_buffer();
+	}
+	free(name);
+}
+
+/*
+ * Keep the cursor column within the row it is on, at the start of a
+ * character.
+ */
+void editor_clamp_cx()
+{
+	erow *row = (E.cy >= E.doc->numrows) ? NULL : editor_row_at(E.cy);
+	int rowlen = row ? row->size : 0;
+	if (E.cx > rowlen) {
+		E.cx = rowlen;
+	}
+	while (E.cx > 0 && E.cx < rowlen && utf8_is_cont(row->chars[E.cx])) {
+		E.cx--;
+	}
 }
 
 /*
- * File I/O.
+ * Find.
+ *
+ * Matches are found with memmem(), which is a two-way matcher in
+ * glibc and is vectorized for short needles.  As long as every row
+ * still points into the mapping, the loaded part of the mapping is
+ * searched as one block, so that a sparse query does not pay a call
+ * per row; the row of a match is then found by binary search over
+ * the row offsets.  Otherwise rows are searched one at a time.
+ *
+ * A query never contains a newline, so no match crosses a row.  That
+ * lets large searches be split into ranges of rows that are scanned
+ * independently by a pool of worker threads.
+ */
+
+/*
+ * Find the first match of query at or after byte off of row at, in
+ * the rows before stop.  Returns the row, and the byte offset in
+ * *moff, or -1 if there is none.
  */
-void editor_open(char *filename)
+int editor_find_forward(char *query, int at, int off, int stop, int *moff)
 {
-	FILE *fp = fopen(filename, "r");
-	if (!fp) {
-		die("fopen");
+	size_t qlen = strlen(query);
+
+	if (at >= stop) {
+		return -1;
+	}
+	if (E.doc->nowned == 0 && at < E.doc->nmapped) {
+		int mstop = stop < E.doc->nmapped ? stop : E.doc->nmapped;
+		erow *last = editor_row_at(mstop - 1);
+		char *p = &editor_row_at(at)->chars[off];
+		char *end = &last->chars[last->size];
+		char *match = memmem(p, end - p, query, qlen);
+		if (match) {
+			int row = editor_offset_to_row(match - E.doc->map);
+			*moff = match - editor_row_at(row)->chars;
+			return row;
+		}
+		at = mstop;
+		off = 0;
 	}
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 &&
-				(line[linelen - 1] == '\n' ||
-				line[linelen - 1] == '\r')) {
-			linelen--;
+	for (; at < stop; at++, off = 0) {
+		erow *row = editor_row_at(at);
+		char *match = memmem(&row->chars[off], row->size - off,
+				query, qlen);
+		if (match) {
+			*moff = match - row->chars;
+			return at;
 		}
-		editor_append_row(line, linelen);
 	}
-	free(line);
-	fclose(fp);
+	return -1;
 }
 
 /*
- * Append buffer.
+ * Find the last match of query that starts before byte off of row at,
+ * in the rows from stop on.
  */
-struct abuf {
-	char *b;
-	int len;
-};
+int editor_find_backward(char *query, int at, int off, int stop, int *moff)
+{
+	size_t qlen = strlen(query);
 
-#define ABUF_INIT {NULL, 0}
+	for (; at >= stop; at--) {
+		erow *row = editor_row_at(at);
 
-void ab_append(struct abuf *ab, const char *s, int len)
-{
-	char *new = realloc(ab->b, ab->len + len);
+		/*
+		 * A match has to start before off and end inside the
+		 * row, so only the first off + qlen - 1 bytes count.
+		 */
+		size_t limit = off + qlen - 1;
+		if (limit > (size_t)row->size) {
+			limit = row->size;
+		}
 
-	if (new == NULL) {
-		return;
+		char *p = row->chars;
+		char *end = &row->chars[limit];
+		char *found = NULL;
+		char *match;
+		while (p < end && (match = memmem(p, end - p, query, qlen))) {
+			found = match;
+			p = match + 1;
+		}
+		if (found) {
+			*moff = found - row->chars;
+			return at;
+		}
+		off = at > 0 ? editor_row_at(at - 1)->size + 1 : 0;
 	}
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
+	return -1;
 }
 
-void ab_free(struct abuf *ab)
+/*
+ * Count the matches of query in rows [at, stop), not counting a match
+ * that overlaps the one before it.
+ */
+size_t editor_count_matches(char *query, int at, int stop)
 {
-	free(ab->b);
+	size_t qlen = strlen(query);
+	size_t count = 0;
+
+	if (at >= stop) {
+		return 0;
+	}
+	if (E.doc->nowned == 0 && at < E.doc->nmapped) {
+		int mstop = stop < E.doc->nmapped ? stop : E.doc->nmapped;
+		erow *last = editor_row_at(mstop - 1);
+		char *p = editor_row_at(at)->chars;
+		char *end = &last->chars[last->size];
+		char *match;
+		while ((match = memmem(p, end - p, query, qlen))) {
+			count++;
+			p = match + qlen;
+		}
+		at = mstop;
+	}
+
+	for (; at < stop; at++) {
+		erow *row = editor_row_at(at);
+		char *p = row->chars;
+		char *end = &row->chars[row->size];
+		char *match;
+		while ((match = memmem(p, end - p, query, qlen))) {
+			count++;
+			p = match + qlen;
+		}
+	}
+	return count;
 }
 
-void editor_scroll()
+/*
+ * A search over many rows is cut into chunks of KILO_SEARCH_ROWS
+ * rows.  Workers claim chunks in file order (or in reverse, searching
+ * backward) through an atomic counter, and the main thread takes part
+ * in the work as well.  For a next or previous match, best is the
+ * claim rank of the nearest chunk that has one; chunks ranked after
+ * it are skipped, and the result is the match of that chunk, so the
+ * answer is the same as a serial scan would give.
+ */
+enum search_kind {
+	SEARCH_NEXT,
+	SEARCH_PREV,
+	SEARCH_COUNT
+};
+
+struct search_job {
+	enum search_kind kind;
+	char *query;
+	int first;
+	int off;
+	int last;
+	int nchunks;
+
+	int next;
+	int best;
+	int *rows;
+	int *offs;
+	size_t *counts;
+};
+
+/*
+ * Workers sleep on work until generation changes, then run job; busy
+ * counts the ones that have not finished it yet.
+ */
+struct search_pool {
+	pthread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	unsigned generation;
+	int busy;
+	struct search_job *job;
+};
+
+struct search_pool search_pool = {
+	NULL, -1, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, 0, 0, NULL
+};
+
+void search_run(struct search_job *job)
 {
-	E.rx = 0;
-	if (E.cy < E.numrows) {
-		E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+	while (1) {
+		int rank = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (rank >= job->nchunks ||
+				rank > __atomic_load_n(&job->best,
+					__ATOMIC_RELAXED)) {
+			return;
+		}
+
+		int c = job->kind == SEARCH_PREV ?
+			job->nchunks - 1 - rank : rank;
+		int lo = job->first + c * KILO_SEARCH_ROWS;
+		int hi = lo + KILO_SEARCH_ROWS;
+		if (hi > job->last) {
+			hi = job->last;
+		}
+
+		int row = -1;
+		int off;
+		switch (job->kind) {
+			case SEARCH_NEXT:
+				row = editor_find_forward(job->query, lo,
+						c == 0 ? job->off : 0, hi,
+						&job->offs[c]);
+				break;
+			case SEARCH_PREV:
+				off = hi == job->last ? job->off :
+					editor_row_at(hi - 1)->size + 1;
+				row = editor_find_backward(job->query, hi - 1,
+						off, lo, &job->offs[c]);
+				break;
+			case SEARCH_COUNT:
+				job->counts[c] = editor_count_matches(
+						job->query, lo, hi);
+				break;
+		}
+		job->rows[c] = row;
+		if (row == -1) {
+			continue;
+		}
+
+		int best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+		while (rank < best && !__atomic_compare_exchange_n(&job->best,
+					&best, rank, 0, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED)) {
+		}
 	}
+}
 
-	if (E.cy < E.rowoff) {
-		E.rowoff = E.cy;
+void *search_worker(void *arg)
+{
+	struct search_pool *pool = arg;
+	unsigned seen = 0;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == seen) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		seen = pool->generation;
+		struct search_job *job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		search_run(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->idle);
+		}
+		pthread_mutex_unlock(&pool->lock);
 	}
-	if (E.cy >= E.rowoff + E.screenrows) {
-		E.rowoff = E.cy - E.screenrows + 1;
+	return NULL;
+}
+
+/*
+ * Start one worker per online CPU besides the main thread, the first
+ * time a search is large enough to need them.  Like the loader, they
+ * run with signals other than SIGBUS blocked.
+ */
+void search_pool_start(struct search_pool *pool)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int want = ncpu > 1 ? (int)(ncpu - 1) : 0;
+	if (want > KILO_SEARCH_MAX_THREADS) {
+		want = KILO_SEARCH_MAX_THREADS;
 	}
 
-	if (E.rx < E.coloff) {
-		E.coloff = E.rx;
+	pool->nthreads = 0;
+	pool->threads = malloc(sizeof(pthread_t) * (want > 0 ? want : 1));
+	if (pool->threads == NULL) {
+		return;
 	}
-	if (E.rx >= E.coloff + E.screencols) {
-		E.coloff = E.rx - E.screencols + 1;
+
+	sigset_t all;
+	sigset_t old;
+	sigfillset(&all);
+	sigdelset(&all, SIGBUS);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	while (pool->nthreads < want && pthread_create(
+				&pool->threads[pool->nthreads], NULL,
+				search_worker, pool) == 0) {
+		pool->nthreads++;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-void editor_draw_rows(struct abuf *ab)
+/*
+ * Run a search over rows [first, last).  Searching forward, off
+ * applies to row first; searching backward, to row last - 1.  Returns
+ * the matching row and sets *moff, or returns -1; counting returns the
+ * number of matches in *count.
+ */
+int editor_search(enum search_kind kind, char *query, int first, int off,
+		int last, int *moff, size_t *count)
 {
-	int i;
-	for (i = 0; i < E.screenrows; i++) {
-		int filerow = i + E.rowoff;
-		if (filerow >= E.numrows) {
-			if (E.numrows == 0 && i == E.screenrows / 3) {
-				char welcome[80];
-				int welcomelen = snprintf(
-					welcome,
-					sizeof(welcome),
-					"Kilo editor -- version %s",
-					KILO_VERSION);
-				if (welcomelen > E.screencols) {
-					welcomelen = E.screencols;
-				}
-				int padding = (E.screencols - welcomelen) / 2;
-				if (padding) {
-					ab_append(ab, "~", 1);
-					padding--;
-				}
-				while (padding--) {
-					ab_append(ab, " ", 1);
-				}
-				ab_append(ab, welcome, welcomelen);
-			} else {
-				ab_append(ab, "~", 1);
-			}
-		} else {
-			int len = E.row[filerow].rsize - E.coloff;
-			/*
-			 * Note that when subtracting E.coloff from the
-			 * length, len can now be a negative number,
-			 * meaning the user scrolled horizontally past
-			 * the end of the line.  In that case, we set
-			 * len to 0 so that nothing is displayed on
-			 * that line.
-			 */
-			if (len < 0) {
-				len = 0;
-			}
-			if (len > E.screencols) {
-				len = E.screencols;
-			}
-			ab_append(ab, &E.row[filerow].render[E.coloff], len);
+	struct search_pool *pool = &search_pool;
+	int nchunks = (last - first + KILO_SEARCH_ROWS - 1) /
+		KILO_SEARCH_ROWS;
+
+	if (nchunks > 1 && pool->nthreads == -1) {
+		search_pool_start(pool);
+	}
+	if (nchunks <= 1 || pool->nthreads <= 0) {
+		switch (kind) {
+			case SEARCH_NEXT:
+				return editor_find_forward(query, first, off,
+						last, moff);
+			case SEARCH_PREV:
+				return editor_find_backward(query, last - 1,
+						off, first, moff);
+			case SEARCH_COUNT:
+				*count = editor_count_matches(query, first,
+						last);
+				return -1;
 		}
-		/*
-		 * The K command (Erase In Line) erases part of the
-		 * current line.  Its argument is analogous to the J
-		 * command's argument: 2 erases the whole line,
-		 * 1 erases the part of the line to the left of the
-		 * cursor, and 0 erases the part of the line to the
-		 * right of the cursor.  0 is the default argument,
-		 * and that's what we want, so we leave out the
-		 * argument and just use <esc>[K.
-		 */
-		ab_append(ab, "\x1b[K", 3);
-		if (i < E.screenrows - 1) {
-			ab_append(ab, "\r\n", 2);
+	}
+
+	struct search_job job;
+	job.kind = kind;
+	job.query = query;
+	job.first = first;
+	job.off = off;
+	job.last = last;
+	job.nchunks = nchunks;
+	job.next = 0;
+	job.best = nchunks;
+	job.rows = malloc(sizeof(int) * nchunks);
+	job.offs = malloc(sizeof(int) * nchunks);
+	job.counts = malloc(sizeof(size_t) * nchunks);
+	if (job.rows == NULL || job.offs == NULL || job.counts == NULL) {
+		die("malloc");
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = &job;
+	pool->busy = pool->nthreads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	search_run(&job);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	int row = -1;
+	if (kind == SEARCH_COUNT) {
+		*count = 0;
+		for (int c = 0; c < nchunks; c++) {
+			*count += job.counts[c];
 		}
+	} else if (job.best < nchunks) {
+		int c = kind == SEARCH_PREV ? nchunks - 1 - job.best :
+			job.best;
+		row = job.rows[c];
+		*moff = job.offs[c];
 	}
+
+	free(job.rows);
+	free(job.offs);
+	free(job.counts);
+	return row;
 }
 
-void editor_refresh_screen()
+void editor_find_callback(char *query, int key)
 {
-	editor_scroll();
+	static int active = 0;
+	static int last_row = -1;
+	static int last_off = 0;
+	static size_t last_len = 0;
+	static char *failed = NULL;
+	static int saved_cx;
+	static int saved_cy;
+	static int saved_rowoff;
+	static int saved_coloff;
+
+	if (!active) {
+		active = 1;
+		saved_cx = E.cx;
+		saved_cy = E.cy;
+		saved_rowoff = E.rowoff;
+		saved_coloff = E.coloff;
+	}
+
+	if (key == '\r' || key == '\x1b') {
+		if (key == '\x1b') {
+			E.cx = saved_cx;
+			E.cy = saved_cy;
+			E.rowoff = saved_rowoff;
+			E.coloff = saved_coloff;
+		}
+		active = 0;
+		last_row = -1;
+		last_len = 0;
+		free(failed);
+		failed = NULL;
+		return;
+	}
 
-	struct abuf ab = ABUF_INIT;
+	size_t len = strlen(query);
+	int direction = 0;
+	int at;
+	int off;
+	if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	} else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	}
 
 	/*
-	 * The l and h commands in the escape sequences below are used
-	 * to tell the terminal to hide and show the cursor.  Note that
-	 * some terminals might not support hiding/showing the cursor,
-	 * because the argument "?25" appeared in later VT models, not
-	 * VT100.
+	 * An empty buffer has no rows to search, and searching backward
+	 * would start at row 0 anyway.
+	 */
+	if (len == 0 || E.doc->numrows == 0) {
+		last_row = -1;
+		last_len = 0;
+		return;
+	}
+	if (direction == 0 && failed && strncmp(query, failed,
+				strlen(failed)) == 0) {
+		/*
+		 * The query extends one that has no match, so it has
+		 * none either, and the file need not be scanned again.
+		 */
+		last_len = len;
+		return;
+	}
+
+	/*
+	 * Typing more resumes from the current match, which is where
+	 * the longer query can first match.  After a deletion the
+	 * search starts over from where it began.
+	 */
+	if (last_row == -1 || (direction == 0 && len < last_len)) {
+		at = saved_cy;
+		off = saved_cx;
+	} else {
+		at = last_row;
+		off = last_off + (direction == 1);
+	}
+	last_len = len;
+
+	/*
+	 * On the line past the end there is nothing before the cursor
+	 * on its own row, so a backward search starts at the end of the
+	 * last row.  A forward one needs no clamp: it wraps to the top.
 	 */
-	ab_append(&ab, "\x1b[?25l", 6);
-	ab_append(&ab, "\x1b[H", 3);
+	if (direction == -1 && at >= E.doc->numrows && E.doc->numrows > 0) {
+		at = E.doc->numrows - 1;
+		off = editor_row_at(at)->size + 1;
+	}
 
-	editor_draw_rows(&ab);
+	int row;
+	int moff = 0;
+	if (direction == -1) {
+		row = editor_search(SEARCH_PREV, query, 0, off, at + 1,
+				&moff, NULL);
+		if (row == -1 && E.doc->numrows > 0) {
+			int last = E.doc->numrows - 1;
+			row = editor_search(SEARCH_PREV, query, 0,
+					editor_row_at(last)->size + 1,
+					E.doc->numrows, &moff, NULL);
+		}
+	} else {
+		row = editor_search(SEARCH_NEXT, query, at, off, E.doc->numrows,
+				&moff, NULL);
+		if (row == -1) {
+			row = editor_search(SEARCH_NEXT, query, 0, 0,
+					E.doc->numrows, &moff, NULL);
+		}
+	}
 
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-			E.cy-E.rowoff+1,
-			E.rx-E.coloff+1);
-	ab_append(&ab, buf, strlen(buf));
-	ab_append(&ab, "\x1b[?25h", 6);
+	free(failed);
+	failed = NULL;
+	if (row == -1) {
+		failed = strdup(query);
+		return;
+	}
+
+	last_row = row;
+	last_off = moff;
+	E.cy = row;
+	E.cx = moff;
+	if (E.cy < E.rowoff || E.cy >= E.rowoff + E.screenrows) {
+		E.rowoff = E.cy - E.screenrows / 2;
+		if (E.rowoff < 0) {
+			E.rowoff = 0;
+		}
+	}
+}
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	ab_free(&ab);
+void editor_find()
+{
+	char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)",
+			editor_find_callback);
+	if (query) {
+		size_t count = 0;
+		editor_search(SEARCH_COUNT, query, 0, 0, E.doc->numrows, NULL,
+				&count);
+		editor_set_status_message("%zu matches for \"%s\"", count,
+				query);
+		free(query);
+	}
 }
 
 void editor_move_cursor(int key)
 {
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = (E.cy >= E.doc->numrows) ? NULL : editor_row_at(E.cy);
 
 	switch (key) {
 		case ARROW_LEFT:
 			if (E.cx != 0) {
-				E.cx--;
+				do {
+					E.cx--;
+				} while (E.cx > 0 && utf8_is_cont(
+							row->chars[E.cx]));
 			} else if (E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = editor_row_at(E.cy)->size;
 			}
 			break;
 		case ARROW_RIGHT:
 			if (row && E.cx < row->size) {
-				E.cx++;
+				do {
+					E.cx++;
+				} while (E.cx < row->size && utf8_is_cont(
+							row->chars[E.cx]));
 			} else if (row && E.cx == row->size) {
 				E.cy++;
 				E.cx = 0;
@@ -530,17 +4716,58 @@ void editor_move_cursor(int key)
 			}
 			break;
 		case ARROW_DOWN:
-			if (E.cy < E.numrows) {
+			if (E.cy < E.doc->numrows) {
 				E.cy++;
 			}
 			break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-	int rowlen = row ? row->size : 0;
-	if (E.cx > rowlen) {
-		E.cx = rowlen;
+	editor_clamp_cx();
+}
+
+/*
+ * Move the cursor n rows down (up if n is negative) in one step.
+ */
+void editor_move_rows(int n)
+{
+	E.cy += n;
+	if (E.cy < 0) {
+		E.cy = 0;
+	}
+	if (E.cy > E.doc->numrows) {
+		E.cy = E.doc->numrows;
 	}
+	editor_clamp_cx();
+}
+
+/*
+ * Scroll the view n rows down (up if n is negative), taking the
+ * cursor along so that it stays at the same place on screen where
+ * possible.
+ */
+void editor_scroll_rows(int n)
+{
+	int maxoff = E.doc->numrows > 0 ? E.doc->numrows - 1 : 0;
+
+	E.rowoff += n;
+	if (E.rowoff > maxoff) {
+		E.rowoff = maxoff;
+	}
+	if (E.rowoff < 0) {
+		E.rowoff = 0;
+	}
+
+	E.cy += n;
+	if (E.cy < E.rowoff) {
+		E.cy = E.rowoff;
+	}
+	if (E.cy > E.rowoff + E.screenrows - 1) {
+		E.cy = E.rowoff + E.screenrows - 1;
+	}
+	if (E.cy > E.doc->numrows) {
+		E.cy = E.doc->numrows;
+	}
+	editor_clamp_cx();
 }
 
 void editor_process_keypress()
@@ -549,17 +4776,42 @@ void editor_process_keypress()
 
 	switch (c) {
 		case CTRL_KEY('q'):
-			write(STDOUT_FILENO, "\x1b[2J", 4);
-			write(STDOUT_FILENO, "\x1b[H", 3);
+			write(E.outfd, "\x1b[2J", 4);
+			write(E.outfd, "\x1b[H", 3);
+			editor_close_all();
 			exit(0);
 			break;
 
+		case CTRL_KEY('o'):
+			editor_open_prompt();
+			break;
+
+		case CTRL_KEY('n'):
+			editor_cycle_buffer(1);
+			break;
+
+		case CTRL_KEY('p'):
+			editor_cycle_buffer(-1);
+			break;
+
+		case CTRL_KEY('w'):
+			editor_close_buffer();
+			break;
+
+		case CTRL_KEY('f'):
+			editor_find();
+			break;
+
+		case CTRL_KEY('g'):
+			editor_goto_line();
+			break;
+
 		case HOME_KEY:
 			E.cx = 0;
 			break;
 		case END_KEY:
-			if (E.cy < E.numrows) {
-				E.cx = E.row[E.cy].size;
+			if (E.cy < E.doc->numrows) {
+				E.cx = editor_row_at(E.cy)->size;
 			}
 			break;
 
@@ -570,19 +4822,33 @@ void editor_process_keypress()
 					E.cy = E.rowoff;
 				} else if (c == PAGE_DOWN) {
 					E.cy = E.rowoff + E.screenrows - 1;
-					if (E.cy > E.numrows) {
-						E.cy = E.numrows;
+					if (E.cy > E.doc->numrows) {
+						E.cy = E.doc->numrows;
 					}
 				}
 
-				int times = E.screenrows;
-				while (times--) {
-					editor_move_cursor(c == PAGE_UP ?
-							ARROW_UP : ARROW_DOWN);
-				}
+				editor_move_rows(c == PAGE_UP ?
+						-E.screenrows : E.screenrows);
+			}
+			break;
+
+		case CTRL_KEY('u'):
+		case CTRL_KEY('d'):
+			{
+				int half = E.screenrows / 2 > 0 ?
+					E.screenrows / 2 : 1;
+				editor_scroll_rows(c == CTRL_KEY('u') ?
+						-half : half);
 			}
 			break;
 
+		case CTRL_KEY('y'):
+			editor_scroll_rows(-1);
+			break;
+		case CTRL_KEY('e'):
+			editor_scroll_rows(1);
+			break;
+
 		case ARROW_UP:
 		case ARROW_DOWN:
 		case ARROW_LEFT:
@@ -592,33 +4858,189 @@ void editor_process_keypress()
 	}
 }
 
+/*
+ * Milliseconds left until the next frame may be drawn.
+ */
+int editor_frame_wait()
+{
+#if KILO_MAX_FPS > 0
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - E.lastframe.tv_sec) * 1000 +
+		(now.tv_nsec - E.lastframe.tv_nsec) / 1000000;
+	long wait = 1000 / KILO_MAX_FPS - elapsed;
+	return wait > 0 ? wait : 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Apply the next key, and every key queued up behind it, before the
+ * screen is refreshed again.  A paste or a held-down key is then drawn
+ * once per batch rather than once per byte.  Keys that arrive before
+ * the next frame is due under KILO_MAX_FPS join the batch too.
+ */
+void editor_process_keys()
+{
+	/*
+	 * The view is scrolled after every key, not just once per
+	 * frame, since keys like PAGE_DOWN move relative to it.
+	 */
+	E.stats.keymark = E.stats.syscalls;
+	E.stats.keysmark = E.stats.keys;
+	do {
+		editor_process_keypress();
+		editor_scroll();
+	} while (editor_wait_input(editor_frame_wait()));
+}
+
 void init_editor()
 {
 	E.cx = 0;
 	E.cy = 0;
 	E.rx = 0;
+	E.inlen = 0;
+	E.inpos = 0;
+	E.rxc.chars = NULL;
+	E.rxc.marks = NULL;
+	E.rxc.nmarks = 0;
+	E.rxc.markcap = 0;
 	E.rowoff = 0;
 	E.coloff = 0;
-	E.numrows = 0;
-	E.row = NULL;
+	E.doc = NULL;
+	E.buffers = NULL;
+	E.nbuffers = 0;
+	E.curbuf = 0;
+	E.follow = 0;
+	editor_add_buffer(editor_new_document());
 
-	if (get_window_size(&E.screenrows, &E.screencols) == -1) {
-		die("get_window_size");
+	E.nwatches = 0;
+	E.statusmsg[0] = '\0';
+	E.statusmsg_time = 0;
+	E.gotowait = 0;
+
+	E.hl = NULL;
+	E.hlcap = 0;
+	E.frame = (struct abuf)ABUF_INIT;
+	E.line = (struct abuf)ABUF_INIT;
+	E.shadow = NULL;
+	E.screenrows = 0;
+	E.screencols = 0;
+	editor_resize();
+	E.shadowcy = 0;
+	E.shadowcx = 0;
+	E.shadowrowoff = 0;
+	E.lastframe.tv_sec = 0;
+	E.lastframe.tv_nsec = 0;
+
+	if (pipe(E.winchfd) == -1) {
+		die("pipe");
+	}
+	fcntl(E.winchfd[0], F_SETFL, O_NONBLOCK);
+	fcntl(E.winchfd[1], F_SETFL, O_NONBLOCK);
+	editor_watch(E.winchfd[0], editor_winch_event);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editor_sigwinch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+		die("sigaction");
 	}
 }
 
 int main(int argc, char *argv[])
 {
+	int follow = 0;
+	int stats = 0;
+	int arg = 1;
+	while (arg < argc) {
+		if (strcmp(argv[arg], "-f") == 0) {
+			follow = 1;
+		} else if (strcmp(argv[arg], "-s") == 0) {
+			stats = 1;
+		} else {
+			break;
+		}
+		arg++;
+	}
+
+	/*
+	 * With "-" the content comes through standard input, so keys
+	 * have to be read from the controlling terminal instead.
+	 */
+	int pager = 0;
+	for (int i = arg; i < argc; i++) {
+		pager |= strcmp(argv[i], "-") == 0;
+	}
+	E.ttyfd = STDIN_FILENO;
+	E.outfd = STDOUT_FILENO;
+	if (pager && !isatty(STDIN_FILENO)) {
+		E.ttyfd = open("/dev/tty", O_RDWR);
+		if (E.ttyfd == -1) {
+			die("open /dev/tty");
+		}
+	}
+
+	/*
+	 * Registered before enable_raw_mode() so that it runs after the
+	 * terminal has been restored.
+	 */
+	if (stats) {
+		E.stats.on = 1;
+		atexit(stats_dump);
+	}
 	enable_raw_mode();
 	init_editor();
+	E.follow = follow;
+
+	struct timespec t;
+	stats_start(&t);
+	for (; arg < argc; arg++) {
+		if (strcmp(argv[arg], "-") != 0) {
+			/*
+			 * A directory leaves an empty buffer, as it
+			 * always has; anything else that cannot be
+			 * opened is fatal.
+			 */
+			if (editor_open(argv[arg]) == -1) {
+				if (errno != EISDIR) {
+					die("open");
+				}
+				editor_set_status_message("Can't open %s: %s",
+					argv[arg], strerror(errno));
+			}
+		} else if (pager) {
+			if (!editor_scratch_buffer()) {
+				editor_add_buffer(editor_new_document());
+			}
+			if (E.ttyfd != STDIN_FILENO) {
+				editor_open_pager();
+			}
+			pager = 0;
+		}
+	}
+	if (E.nbuffers > 1) {
+		editor_switch_buffer(0);
+	}
+	stats_stop(&E.stats.open, &t);
 
-	if (argc >= 2) {
-		editor_open(argv[1]);
+	/*
+	 * A file that was loaded whole while it was opened may already
+	 * have something to say about its line endings.
+	 */
+	if (E.statusmsg[0] == '\0') {
+		editor_set_status_message("HELP: Ctrl-Q quit | Ctrl-F find | "
+			"Ctrl-G goto | Ctrl-O open | Ctrl-N/P/W buffer");
 	}
 
 	while (1) {
 		editor_refresh_screen();
-		editor_process_keypress();
+		if (editor_wait_events()) {
+			editor_process_keys();
+		}
 	}
 
 	return 0;